@@ -0,0 +1,559 @@
+// Headless benchmarks of the ECS, one JSON object per line on stdout:
+//
+//   ecs_bench [--max-entities N] [--repeats R] [--filter SUBSTRING]
+//
+// Each benchmark runs `repeats` times on a fresh setup, the minimum and median
+// times are reported. Entities are spread over 1, 16 or 256 archetypes by
+// tagging them with subsets of tag<0>..tag<7>.
+#include "ecs.h"
+#include "hierarchy.h"
+#include "nostd.h"
+#include "snapshot.h"
+#include "spatial.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdlib>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <random>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+namespace {
+
+struct pos : nostd::vec2 {};
+struct speed : nostd::vec2 {};
+// Added and removed by the migration benchmark.
+struct marker {
+  std::uint32_t value;
+};
+// Same, toggled by the sparse set benchmark.
+struct sparse_marker {
+  static constexpr ecs::storage_policy storage =
+      ecs::storage_policy::sparse_set;
+  std::uint32_t value;
+};
+// Of a child relative to its parent, see the hierarchy benchmarks.
+struct offset : nostd::vec2 {};
+template <std::size_t I> struct tag {
+  std::uint8_t value;
+};
+
+constexpr std::size_t tag_count = 8;
+
+using registry =
+    ecs::StaticRegistry<pos, speed, marker, sparse_marker, offset,
+                        ecs::ChildOf, tag<0>, tag<1>, tag<2>, tag<3>, tag<4>,
+                        tag<5>, tag<6>, tag<7>>;
+using World = ecs::basic_world<registry>;
+
+struct options {
+  std::size_t max_entities = 10'000'000;
+  std::size_t repeats = 5;
+  std::string_view filter;
+};
+
+struct timing {
+  double min_ns;
+  double median_ns;
+};
+
+struct run_info {
+  std::string_view name;
+  std::size_t entities;
+  std::size_t archetypes;
+  std::size_t threads;
+};
+
+const options *opts = nullptr;
+
+void report(const run_info &info, std::size_t repeats, const timing &t,
+            std::size_t operations) {
+  nostd::println("{{\"name\":\"{}\",\"entities\":{},\"archetypes\":{},"
+                 "\"threads\":{},\"repeats\":{},\"min_ns\":{:.0f},"
+                 "\"median_ns\":{:.0f},\"ns_per_op\":{:.3f}}}",
+                 info.name, info.entities, info.archetypes, info.threads,
+                 repeats, t.min_ns, t.median_ns,
+                 t.min_ns / static_cast<double>(std::max<std::size_t>(
+                                operations, 1)));
+}
+
+bool selected(std::string_view name) {
+  return name.find(opts->filter) != std::string_view::npos;
+}
+
+// Large runs are repeated less, their setup dominates.
+std::size_t repeats_for(std::size_t entities) {
+  return entities >= 10'000'000 ? std::min<std::size_t>(opts->repeats, 3)
+                                : opts->repeats;
+}
+
+// Times `run(state)` on a fresh `setup()` each time.
+template <class Setup, class Run>
+void measure(const run_info &info, std::size_t operations, Setup &&setup,
+             Run &&run) {
+  if (!selected(info.name)) {
+    return;
+  }
+
+  const auto repeats = repeats_for(info.entities);
+  std::vector<double> samples;
+  for (std::size_t r = 0; r < repeats; r++) {
+    auto state = setup();
+    const auto start = std::chrono::steady_clock::now();
+    run(state);
+    const auto end = std::chrono::steady_clock::now();
+    samples.push_back(
+        std::chrono::duration<double, std::nano>(end - start).count());
+  }
+  std::ranges::sort(samples);
+  report(info, repeats, {samples.front(), samples[samples.size() / 2]},
+         operations);
+}
+
+// Keeps the result of a computation from being optimized away.
+template <class T> void keep(const T &value) {
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+// Calls `fn.template operator()<Tags...>()` with the tags whose bit is set in
+// `mask`, which picks one of the 2^tag_count archetypes at runtime.
+template <std::size_t Bit = 0, class... Tags, class Fn>
+decltype(auto) with_tags(std::size_t mask, Fn &&fn) {
+  if constexpr (Bit == tag_count) {
+    return fn.template operator()<Tags...>();
+  } else if (mask & (std::size_t{1} << Bit)) {
+    return with_tags<Bit + 1, Tags..., tag<Bit>>(mask, fn);
+  } else {
+    return with_tags<Bit + 1, Tags...>(mask, fn);
+  }
+}
+
+// Entities of the `a`-th of `archetypes` archetypes when spreading `n`.
+std::size_t share(std::size_t n, std::size_t archetypes, std::size_t a) {
+  return n / archetypes + (a < n % archetypes ? 1 : 0);
+}
+
+// Inserts `count` entities with pos, speed and the tags of `mask`.
+std::vector<ecs::entity_t> insert_tagged(World &world, std::size_t mask,
+                                         std::size_t count) {
+  return with_tags(mask, [&]<class... Tags> {
+    return world.insert_batch<pos, speed, Tags...>(count, [](std::size_t i) {
+      const auto f = static_cast<float>(i);
+      return std::tuple{pos{{f, f}}, speed{{1, 1}}, Tags{}...};
+    });
+  });
+}
+
+struct populated {
+  std::unique_ptr<World> world;
+  std::vector<ecs::entity_t> entities;
+};
+
+populated populate(std::size_t entities, std::size_t archetypes,
+                   bool dense = true) {
+  populated out{std::make_unique<World>(), {}};
+  out.world->dense = dense;
+  out.entities.reserve(entities);
+  for (std::size_t a = 0; a < archetypes; a++) {
+    const auto inserted =
+        insert_tagged(*out.world, a, share(entities, archetypes, a));
+    out.entities.insert(out.entities.end(), inserted.begin(), inserted.end());
+  }
+  return out;
+}
+
+void structural(std::size_t n, std::size_t archetypes) {
+  const run_info base{"", n, archetypes, 1};
+
+  auto info = base;
+  info.name = "insert";
+  measure(
+      info, n, [] { return std::make_unique<World>(); },
+      [&](std::unique_ptr<World> &world) {
+        for (std::size_t a = 0; a < archetypes; a++) {
+          with_tags(a, [&]<class... Tags> {
+            for (std::size_t i = 0; i < share(n, archetypes, a); i++) {
+              const auto f = static_cast<float>(i);
+              keep(world->insert(pos{{f, f}}, speed{{1, 1}}, Tags{}...));
+            }
+          });
+        }
+      });
+
+  info.name = "insert_batch";
+  measure(
+      info, n, [] { return std::make_unique<World>(); },
+      [&](std::unique_ptr<World> &world) {
+        for (std::size_t a = 0; a < archetypes; a++) {
+          keep(insert_tagged(*world, a, share(n, archetypes, a)).size());
+        }
+      });
+
+  // Despawns a tenth of the entities at random and inserts as many.
+  const auto churn = std::max<std::size_t>(n / 10, 1);
+  info.name = "despawn_churn";
+  measure(
+      info, 2 * churn,
+      [&] {
+        auto p = populate(n, archetypes);
+        std::mt19937_64 rng{42};
+        std::shuffle(p.entities.begin(), p.entities.end(), rng);
+        p.entities.resize(std::min(churn, p.entities.size()));
+        return p;
+      },
+      [&](populated &p) {
+        for (const auto ent : p.entities) {
+          p.world->despawn(ent);
+        }
+        for (std::size_t a = 0; a < archetypes; a++) {
+          keep(insert_tagged(*p.world, a, share(churn, archetypes, a)).size());
+        }
+      });
+
+  // Gives a tenth of the entities a component, then takes it back.
+  info.name = "migrate";
+  measure(
+      info, 2 * churn,
+      [&] {
+        auto p = populate(n, archetypes);
+        std::mt19937_64 rng{43};
+        std::shuffle(p.entities.begin(), p.entities.end(), rng);
+        p.entities.resize(std::min(churn, p.entities.size()));
+        return p;
+      },
+      [&](populated &p) {
+        for (const auto ent : p.entities) {
+          p.world->add(ent, marker{1});
+        }
+        for (const auto ent : p.entities) {
+          p.world->remove<marker>(ent);
+        }
+      });
+
+  // Same with a sparse set component, which moves no entity.
+  info.name = "toggle_sparse";
+  measure(
+      info, 2 * churn,
+      [&] {
+        auto p = populate(n, archetypes);
+        std::mt19937_64 rng{43};
+        std::shuffle(p.entities.begin(), p.entities.end(), rng);
+        p.entities.resize(std::min(churn, p.entities.size()));
+        return p;
+      },
+      [&](populated &p) {
+        for (const auto ent : p.entities) {
+          p.world->add(ent, sparse_marker{1});
+        }
+        for (const auto ent : p.entities) {
+          p.world->remove<sparse_marker>(ent);
+        }
+      });
+
+  // Packs the chunks of a world that is not dense once half of its entities,
+  // picked at random, are despawned.
+  info.name = "defragment";
+  measure(
+      info, n - n / 2,
+      [&] {
+        auto p = populate(n, archetypes, false);
+        std::mt19937_64 rng{48};
+        std::shuffle(p.entities.begin(), p.entities.end(), rng);
+        for (std::size_t i = 0; i < n / 2; i++) {
+          p.world->despawn(p.entities[i]);
+        }
+        return p;
+      },
+      [&](populated &p) { keep(p.world->defragment()); });
+
+  // Reverses the order of the entities of each archetype.
+  info.name = "sort_by";
+  measure(
+      info, n, [&] { return populate(n, archetypes); },
+      [&](populated &p) {
+        p.world->sort_by<pos>([](const pos &value) { return -value.x; });
+      });
+}
+
+// Saving a world and restoring it by copy or by adopting the mapped chunks.
+void snapshots(std::size_t n, std::size_t archetypes) {
+  if (!selected("snapshot")) {
+    return;
+  }
+  const auto path =
+      (std::filesystem::temp_directory_path() / "ecs_bench.snap").string();
+  const auto p = populate(n, archetypes);
+  run_info info{"snapshot_save", n, archetypes, 1};
+  measure(
+      info, n, [] { return 0; },
+      [&](int) { ecs::save_snapshot(*p.world, path.c_str()); });
+
+  for (const bool adopt : {false, true}) {
+    info.name = adopt ? "snapshot_adopt" : "snapshot_restore";
+    measure(
+        info, n, [] { return std::make_unique<World>(); },
+        [&](std::unique_ptr<World> &world) {
+          ecs::snapshot_file file{path.c_str()};
+          file.restore(*world, adopt);
+          // Don't let the mapping go before the adopted chunks.
+          world.reset();
+        });
+  }
+  std::filesystem::remove(path);
+}
+
+void iteration(std::size_t n, std::size_t archetypes) {
+  // Iterations don't change the world, share it between the repeats.
+  std::optional<populated> p;
+  const auto shared = [&] {
+    if (!p) {
+      p = populate(n, archetypes);
+    }
+    return &*p;
+  };
+  const run_info base{"", n, archetypes, 1};
+
+  auto info = base;
+  info.name = "query_1_iter";
+  measure(info, n, shared, [](populated *p) {
+    float sum = 0;
+    for (auto [pos] : p->world->query<const pos>()) {
+      sum += pos.x;
+    }
+    keep(sum);
+  });
+
+  info.name = "query_1_chunk";
+  measure(info, n, shared, [](populated *p) {
+    float sum = 0;
+    p->world->query<const pos>().for_each_chunk(
+        [&](std::span<const pos> pos) {
+          for (const auto &p : pos) {
+            sum += p.x;
+          }
+        });
+    keep(sum);
+  });
+
+  info.name = "query_2_iter";
+  measure(info, n, shared, [](populated *p) {
+    for (auto [pos, speed] : p->world->query<pos, const speed>()) {
+      pos.x += speed.x;
+      pos.y += speed.y;
+    }
+  });
+
+  info.name = "query_2_chunk";
+  measure(info, n, shared, [](populated *p) {
+    p->world->query<pos, const speed>().for_each_chunk(
+        [](std::span<pos> pos, std::span<const speed> speed) {
+          for (std::size_t i = 0; i < pos.size(); i++) {
+            pos[i].x += speed[i].x;
+            pos[i].y += speed[i].y;
+          }
+        });
+  });
+
+  // What a new query does with the archetypes it has not seen.
+  info.name = "match_archetypes";
+  measure(info, archetypes, shared, [](populated *p) {
+    const auto &world = *p->world;
+    std::size_t matched = 0;
+    ecs::match_type_sets<registry::max_components>(
+        world.archetype_types_, p->world->as_type_set<pos, tag<0>>(),
+        p->world->as_type_set<tag<1>>(), [&](std::size_t) { matched++; });
+    keep(matched);
+  });
+
+  // entity() on handles in random order.
+  std::vector<ecs::entity_t> shuffled;
+  const auto with_shuffled = [&] {
+    auto *p = shared();
+    if (shuffled.empty()) {
+      shuffled = p->entities;
+      std::mt19937_64 rng{44};
+      std::shuffle(shuffled.begin(), shuffled.end(), rng);
+    }
+    return p;
+  };
+  info.name = "random_entity";
+  measure(info, n, with_shuffled, [&](populated *p) {
+    float sum = 0;
+    for (const auto ent : shuffled) {
+      sum += std::get<0>(p->world->entity<const pos>(ent)).x;
+    }
+    keep(sum);
+  });
+
+  // Same kernel as query_2_chunk on pools of increasing size.
+  if (n < 100'000) {
+    return;
+  }
+  const std::size_t cores = std::max(std::thread::hardware_concurrency(), 1u);
+  for (std::size_t threads = 1;; threads = std::min(2 * threads, cores)) {
+    info.name = "par_query_2_chunk";
+    info.threads = threads;
+    ecs::thread_pool pool{threads - 1};
+    measure(info, n, shared, [&](populated *p) {
+      p->world->query<pos, const speed>().par_for_each_chunk(
+          [](std::span<pos> pos, std::span<const speed> speed) {
+            for (std::size_t i = 0; i < pos.size(); i++) {
+              pos[i].x += speed[i].x;
+              pos[i].y += speed[i].y;
+            }
+          },
+          hive::default_chunk_capacity, pool);
+    });
+    if (threads == cores) {
+      break;
+    }
+  }
+}
+
+// A sixteenth of the entities are roots, the others children of a random
+// entity inserted before them.
+void hierarchies(std::size_t n) {
+  World world;
+  std::vector<ecs::entity_t> entities;
+  entities.reserve(n);
+  std::mt19937_64 rng{46};
+  for (std::size_t i = 0; i < n; i++) {
+    const auto f = static_cast<float>(i);
+    if (i % 16 == 0) {
+      entities.push_back(world.insert(pos{{f, f}}));
+    } else {
+      entities.push_back(world.insert(pos{}, offset{{1, 1}},
+                                      ecs::ChildOf{entities[rng() % i]}));
+    }
+  }
+
+  run_info info{"hierarchy_rebuild", n, world.archetypes_.size(), 1};
+  measure(
+      info, n, [] { return ecs::hierarchy<World>{}; },
+      [&](ecs::hierarchy<World> &h) { h.update(world); });
+
+  ecs::hierarchy<World> h;
+  h.update(world);
+  const std::size_t cores = std::max(std::thread::hardware_concurrency(), 1u);
+  for (std::size_t threads = 1;; threads = std::min(2 * threads, cores)) {
+    info.name = "hierarchy_propagate";
+    info.threads = threads;
+    ecs::thread_pool pool{threads - 1};
+    measure(info, n, [&] { return &h; }, [&](ecs::hierarchy<World> *h) {
+      h->propagate<offset, pos>(
+          world,
+          [](const pos &parent, const offset &local) {
+            return pos{{parent.x + local.x, parent.y + local.y}};
+          },
+          4096, pool);
+    });
+    if (threads == cores) {
+      break;
+    }
+  }
+}
+
+// Entities spread uniformly over a square with an average of 4 per cell,
+// each looking for its neighbors within a cell size.
+void spatial(std::size_t n) {
+  World world;
+  std::mt19937_64 rng{47};
+  const auto side = 2 * std::sqrt(static_cast<float>(n));
+  std::uniform_real_distribution<float> coord{0, side};
+  world.insert_batch<pos>(n, [&](std::size_t) {
+    return std::tuple{pos{{coord(rng), coord(rng)}}};
+  });
+
+  using grid = ecs::spatial_grid<World, pos>;
+  run_info info{"spatial_rebuild", n, 1, 1};
+  measure(
+      info, n, [] { return grid{1}; }, [&](grid &g) { g.update(world); });
+
+  grid g{1};
+  g.update(world);
+  info.name = "spatial_neighbors";
+  measure(info, n, [&] { return &g; }, [&](grid *g) {
+    std::size_t found = 0;
+    for (const auto &e : g->entries()) {
+      g->query_radius(e.x, e.y, 1, [&](std::span<const grid::entry> batch) {
+        found += batch.size();
+      });
+    }
+    keep(found);
+  });
+}
+
+// Lookups of a world whose registry gives the components their index at
+// runtime, on a single archetype.
+void dynamic(std::size_t n) {
+  using Dynamic = ecs::DynamicWorld;
+  Dynamic world;
+  auto entities = world.insert_batch<pos, speed>(n, [](std::size_t i) {
+    const auto f = static_cast<float>(i);
+    return std::tuple{pos{{f, f}}, speed{{1, 1}}};
+  });
+  std::mt19937_64 rng{45};
+  std::shuffle(entities.begin(), entities.end(), rng);
+  const run_info info{"dynamic_random_entity", n, 1, 1};
+  measure(info, n, [&] { return &world; }, [&](Dynamic *world) {
+    float sum = 0;
+    for (const auto ent : entities) {
+      sum += std::get<0>(world->entity<const pos>(ent)).x;
+    }
+    keep(sum);
+  });
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  options o;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    const std::string_view arg = argv[i];
+    if (arg == "--max-entities") {
+      o.max_entities = std::strtoull(argv[i + 1], nullptr, 10);
+    } else if (arg == "--repeats") {
+      o.repeats = std::max<std::size_t>(
+          std::strtoull(argv[i + 1], nullptr, 10), 1);
+    } else if (arg == "--filter") {
+      o.filter = argv[i + 1];
+    } else {
+      nostd::println("usage: {} [--max-entities N] [--repeats R] "
+                     "[--filter SUBSTRING]",
+                     argv[0]);
+      return 1;
+    }
+  }
+  opts = &o;
+  // Timings of the benchmarks themselves, not of the profiler.
+  ecs::profiler::global().set_enabled(false);
+
+  for (std::size_t n = 1'000; n <= o.max_entities; n *= 10) {
+    for (const std::size_t archetypes : {1, 16, 256}) {
+      if (archetypes > n) {
+        continue;
+      }
+      structural(n, archetypes);
+      snapshots(n, archetypes);
+      iteration(n, archetypes);
+    }
+    if (selected("dynamic_random_entity")) {
+      dynamic(n);
+    }
+    if (selected("hierarchy_rebuild") || selected("hierarchy_propagate")) {
+      hierarchies(n);
+    }
+    if (selected("spatial_rebuild") || selected("spatial_neighbors")) {
+      spatial(n);
+    }
+  }
+}
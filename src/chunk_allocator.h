@@ -0,0 +1,166 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <sys/mman.h>
+
+#include "nostd.h"
+
+// Where hives get the storage of their chunks from. Shared by all the
+// archetypes of a world, see basic_world::basic_world.
+class chunk_allocator {
+public:
+  virtual ~chunk_allocator() = default;
+  virtual std::byte *allocate(std::size_t bytes, std::size_t alignment) = 0;
+  virtual void deallocate(std::byte *p, std::size_t bytes,
+                          std::size_t alignment) = 0;
+};
+
+// Every chunk on its own from the global heap.
+class heap_chunk_allocator final : public chunk_allocator {
+public:
+  static heap_chunk_allocator &instance() {
+    static heap_chunk_allocator allocator;
+    return allocator;
+  }
+
+  std::byte *allocate(std::size_t bytes, std::size_t alignment) override {
+    return static_cast<std::byte *>(
+        ::operator new[](bytes, std::align_val_t{alignment}));
+  }
+  void deallocate(std::byte *p, std::size_t, std::size_t alignment) override {
+    ::operator delete[](p, std::align_val_t{alignment});
+  }
+};
+
+// Chunks carved out of large blocks mapped from the OS, and only given back
+// when the arena is destroyed: it must outlive the worlds using it.
+//
+// Blocks can be backed by transparent huge pages, so that a block of chunks
+// costs a handful of TLB entries instead of one per 4KB page.
+class arena_chunk_allocator : public chunk_allocator {
+  struct block {
+    void *data;
+    std::size_t size;
+  };
+
+  std::vector<block> blocks_;
+  std::byte *cur_ = nullptr;
+  std::byte *end_ = nullptr;
+
+  std::size_t block_size_;
+  bool huge_pages_;
+
+protected:
+  std::mutex mutex_;
+
+  // Bump allocates, mutex_ must be held.
+  std::byte *carve(std::size_t bytes, std::size_t alignment) {
+    const auto aligned = [&] {
+      return reinterpret_cast<std::byte *>(nostd::align_up(
+          reinterpret_cast<std::uintptr_t>(cur_), alignment));
+    };
+    if (cur_ == nullptr || aligned() + bytes > end_) {
+      map_block(bytes + alignment);
+    }
+
+    auto *p = aligned();
+    cur_ = p + bytes;
+    assert(cur_ <= end_);
+    return p;
+  }
+
+private:
+  void map_block(std::size_t min_size) {
+    constexpr std::size_t huge_page = 2 * 1024 * 1024;
+    const auto size = nostd::align_up(std::max(min_size, block_size_),
+                                      huge_pages_ ? huge_page : 4096);
+    // Over-map to be able to align the block on a huge page.
+    const auto mapped = huge_pages_ ? size + huge_page : size;
+    void *raw = mmap(nullptr, mapped, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) {
+      throw std::bad_alloc{};
+    }
+
+    auto *data = static_cast<std::byte *>(raw);
+    if (huge_pages_) {
+      auto *aligned = reinterpret_cast<std::byte *>(nostd::align_up(
+          reinterpret_cast<std::uintptr_t>(data), huge_page));
+      if (aligned != data) {
+        munmap(data, aligned - data);
+      }
+      const auto tail = (data + mapped) - (aligned + size);
+      if (tail != 0) {
+        munmap(aligned + size, tail);
+      }
+      data = aligned;
+#ifdef MADV_HUGEPAGE
+      madvise(data, size, MADV_HUGEPAGE);
+#endif
+    }
+
+    blocks_.push_back({data, size});
+    cur_ = data;
+    end_ = data + size;
+  }
+
+public:
+  static constexpr std::size_t default_block_size = 64 * 1024 * 1024;
+
+  explicit arena_chunk_allocator(bool huge_pages = false,
+                                 std::size_t block_size = default_block_size)
+      : block_size_(block_size), huge_pages_(huge_pages) {}
+
+  ~arena_chunk_allocator() override {
+    for (const auto &b : blocks_) {
+      munmap(b.data, b.size);
+    }
+  }
+
+  arena_chunk_allocator(const arena_chunk_allocator &) = delete;
+  arena_chunk_allocator &operator=(const arena_chunk_allocator &) = delete;
+
+  std::byte *allocate(std::size_t bytes, std::size_t alignment) override {
+    std::scoped_lock lock{mutex_};
+    return carve(bytes, alignment);
+  }
+  void deallocate(std::byte *, std::size_t, std::size_t) override {}
+};
+
+// Arena whose freed chunks are kept to be handed out again, to chunks of
+// any archetype with the same chunk size and alignment.
+class pool_chunk_allocator final : public arena_chunk_allocator {
+  // Free chunks by (size, alignment).
+  std::unordered_map<std::size_t,
+                     std::unordered_map<std::size_t, std::vector<std::byte *>>>
+      free_;
+
+public:
+  using arena_chunk_allocator::arena_chunk_allocator;
+
+  std::byte *allocate(std::size_t bytes, std::size_t alignment) override {
+    std::scoped_lock lock{mutex_};
+    auto &chunks = free_[bytes][alignment];
+    if (!chunks.empty()) {
+      auto *p = chunks.back();
+      chunks.pop_back();
+      return p;
+    }
+    return carve(bytes, alignment);
+  }
+
+  void deallocate(std::byte *p, std::size_t bytes,
+                  std::size_t alignment) override {
+    std::scoped_lock lock{mutex_};
+    free_[bytes][alignment].push_back(p);
+  }
+};
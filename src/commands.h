@@ -0,0 +1,121 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <type_traits>
+#include <vector>
+
+namespace ecs {
+
+enum class entity_t : uint64_t;
+
+// Structural changes recorded while systems run, to be applied later by
+// basic_world::flush. Each thread records in its own buffer, see
+// basic_world::commands, so recording from parallel systems is safe with
+// either registry: the component lookups it makes don't race, see
+// DynamicRegistry.
+template <class World> class command_buffer {
+public:
+  using type_set = World::type_set;
+
+  enum class kind : std::uint8_t {
+    insert,
+    despawn,
+    add,
+    remove,
+  };
+
+  // A recorded component: its type and where its bytes are in `bytes`.
+  struct component_value {
+    std::size_t type_index;
+    std::size_t offset;
+  };
+
+  struct command {
+    kind op;
+    // Unused by inserts.
+    entity_t ent;
+    // Of the inserted entity for inserts, of the component for add / remove.
+    type_set types;
+    // values[first_value, first_value + value_count) for inserts and adds.
+    std::size_t first_value;
+    std::size_t value_count;
+  };
+
+  explicit command_buffer(World *world) : world_(world) {}
+
+  template <class... Ts> void insert(Ts &&...ts) {
+    commands_.push_back({
+        .op = kind::insert,
+        .ent = {},
+        .types = world_->template as_type_set<std::remove_cvref_t<Ts>...>(),
+        .first_value = values_.size(),
+        .value_count = sizeof...(Ts),
+    });
+    (record(ts), ...);
+  }
+
+  void despawn(entity_t ent) {
+    commands_.push_back({
+        .op = kind::despawn,
+        .ent = ent,
+        .types = {},
+        .first_value = 0,
+        .value_count = 0,
+    });
+  }
+
+  template <class T> void add(entity_t ent, const T &value) {
+    commands_.push_back({
+        .op = kind::add,
+        .ent = ent,
+        .types = world_->template as_type_set<T>(),
+        .first_value = values_.size(),
+        .value_count = 1,
+    });
+    record(value);
+  }
+
+  template <class T> void remove(entity_t ent) {
+    commands_.push_back({
+        .op = kind::remove,
+        .ent = ent,
+        .types = world_->template as_type_set<T>(),
+        .first_value = 0,
+        .value_count = 0,
+    });
+  }
+
+  std::span<const command> commands() const { return commands_; }
+  std::span<const component_value> values(const command &cmd) const {
+    return std::span(values_).subspan(cmd.first_value, cmd.value_count);
+  }
+  const std::byte *bytes(const component_value &value) const {
+    return bytes_.data() + value.offset;
+  }
+
+  void clear() {
+    commands_.clear();
+    values_.clear();
+    bytes_.clear();
+  }
+
+private:
+  World *world_;
+  std::vector<command> commands_;
+  std::vector<component_value> values_;
+  std::vector<std::byte> bytes_;
+
+  template <class T> void record(const T &value) {
+    values_.push_back({
+        .type_index =
+            world_->registry.template index<std::remove_cvref_t<T>>(),
+        .offset = bytes_.size(),
+    });
+    bytes_.resize(bytes_.size() + sizeof(T));
+    std::memcpy(bytes_.data() + bytes_.size() - sizeof(T), &value, sizeof(T));
+  }
+};
+} // namespace ecs
@@ -0,0 +1,531 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <ostream>
+#include <span>
+#include <stdexcept>
+#include <vector>
+
+#include "ecs.h"
+#include "snapshot.h"
+
+namespace ecs {
+
+// Frames of a delta stream bring a replica world up to date with a source
+// world, sending only the chunks whose entities or change ticks moved since
+// the previous frame. Of a chunk whose entities did not move only the change
+// ticks, the entity column and the changed columns are sent, the whole chunk
+// of packed rows. Sparse sets are sent as tables, like the entity table, when
+// they changed. Bytes can be XORed with what the replica already has, which
+// turns what did not change into zeros, and runs of zeros sent as a count.
+//
+// Frames must be applied in order to a replica that starts empty and whose
+// components are only written by apply_delta(): XORed frames would decode
+// the bytes written locally into garbage. Change ticks are always sent raw,
+// so queries with non-const terms are fine as long as they don't write. The
+// chunks share the layout of the source chunks, hence the same restrictions
+// as snapshots.
+//
+// In order, with snapshot_writer alignment:
+//   delta_header
+//   delta_table, then if present a delta_blob of entity_location
+//   delta_table, then if present a delta_blob of free entity indices
+//   snapshot_archetype[archetypes new since the previous frame]
+//   per archetype:       delta_archetype
+//   per changed chunk:   delta_chunk, then if the chunk has storage
+//                        std::uint64_t[occupancy words]
+//   per range of bytes:  delta_range, delta_blob, never XORed if raw
+//   per sparse set:      snapshot_sparse_set, then as delta_table and blob
+//                        its entity indices, change ticks (raw) and
+//                        components
+struct delta_header {
+  static constexpr std::array<char, 8> expected_magic = {'E', 'C', 'S', 'D',
+                                                         'E', 'L', 'T', 'A'};
+  static constexpr std::uint32_t current_version = 4;
+  static constexpr std::uint32_t xor_previous = 1;
+  static constexpr std::uint32_t zero_runs = 2;
+
+  std::array<char, 8> magic;
+  std::uint32_t version;
+  std::uint32_t max_components;
+  std::uint64_t tick;
+  std::uint64_t entities;
+  std::uint64_t free_entities;
+  std::uint64_t archetypes;
+  std::uint64_t sparse_sets;
+  std::uint32_t flags;
+};
+
+struct delta_table {
+  std::uint64_t present;
+};
+
+// `size` bytes that take `encoded` bytes in the stream. With zero_runs they
+// are [std::uint32_t zeros][std::uint32_t literals][literals] tokens,
+// unaligned.
+struct delta_blob {
+  std::uint64_t size;
+  std::uint64_t encoded;
+};
+
+struct delta_archetype {
+  std::uint64_t chunks;
+  std::uint64_t changed;
+};
+
+struct delta_chunk {
+  std::uint32_t index;
+  std::uint32_t ranges;
+  std::uint64_t allocated;
+};
+
+struct delta_range {
+  std::uint64_t offset;
+  std::uint64_t size;
+  // The change ticks of the chunk, which the replica may have stamped.
+  std::uint64_t raw;
+};
+
+struct delta_options {
+  // XOR the bytes sent with the ones the replica has.
+  bool xor_previous = true;
+  // Send runs of zero bytes as a count.
+  bool zero_runs = true;
+};
+
+// Encodes the frames of one replica, remembering what it was sent.
+template <class Registry> class delta_encoder {
+  static constexpr auto N = Registry::max_components;
+  using world_t = basic_world<Registry>;
+
+  struct shadow_chunk {
+    bool allocated = false;
+    std::vector<std::uint64_t> occupied;
+    // Only with xor_previous.
+    std::vector<std::byte> data;
+  };
+  struct shadow_set {
+    std::vector<std::uint32_t> entities;
+    std::vector<change_ticks> ticks;
+    std::vector<std::byte> bytes;
+  };
+
+  delta_options options_;
+  // Ticks after this one are changes the replica was not sent.
+  std::uint64_t since_ = 0;
+  std::vector<entity_location> entities_;
+  std::vector<std::uint32_t> free_entities_;
+  std::vector<std::vector<shadow_chunk>> chunks_;
+  std::array<shadow_set, N> sets_;
+
+  struct range {
+    std::size_t offset;
+    std::size_t size;
+    bool raw = false;
+  };
+  struct changed_chunk {
+    std::size_t index;
+    // ranges_[first, last).
+    std::size_t first;
+    std::size_t last;
+  };
+  std::vector<range> ranges_;
+  std::vector<changed_chunk> changed_;
+  std::vector<std::byte> scratch_;
+
+  static constexpr std::size_t min_zero_run = 8;
+
+  // Appends `size` bytes of `data`, XORed with `previous` unless null.
+  void blob(snapshot_writer &w, const std::byte *data,
+            const std::byte *previous, std::size_t size) {
+    const auto at = [&](std::size_t i) {
+      return previous != nullptr ? data[i] ^ previous[i] : data[i];
+    };
+    const auto word_at = [&](std::size_t i) {
+      std::uint64_t a;
+      std::memcpy(&a, data + i, sizeof(a));
+      if (previous != nullptr) {
+        std::uint64_t b;
+        std::memcpy(&b, previous + i, sizeof(b));
+        a ^= b;
+      }
+      return a;
+    };
+
+    scratch_.clear();
+    if (!options_.zero_runs) {
+      scratch_.resize(size);
+      for (std::size_t i = 0; i < size; i++) {
+        scratch_[i] = at(i);
+      }
+    }
+
+    for (std::size_t i = 0; options_.zero_runs && i < size;) {
+      const auto zeros_begin = i;
+      while (i + sizeof(std::uint64_t) <= size && word_at(i) == 0) {
+        i += sizeof(std::uint64_t);
+      }
+      while (i < size && at(i) == std::byte{0}) {
+        i++;
+      }
+
+      // Literals end at the next long enough run of zeros.
+      const auto literals_begin = i;
+      std::size_t zeros = 0;
+      while (i < size && zeros < min_zero_run) {
+        zeros = at(i) == std::byte{0} ? zeros + 1 : 0;
+        i++;
+      }
+      i -= zeros;
+
+      const std::array<std::uint32_t, 2> token = {
+          static_cast<std::uint32_t>(literals_begin - zeros_begin),
+          static_cast<std::uint32_t>(i - literals_begin),
+      };
+      const auto *t = reinterpret_cast<const std::byte *>(token.data());
+      scratch_.insert(scratch_.end(), t, t + sizeof(token));
+      for (auto j = literals_begin; j < i; j++) {
+        scratch_.push_back(at(j));
+      }
+    }
+
+    w.write(delta_blob{.size = size, .encoded = scratch_.size()});
+    w.bytes(scratch_.data(), scratch_.size());
+  }
+
+  // A raw table is never XORed.
+  template <class T>
+  void table(snapshot_writer &w, std::span<const T> current,
+             std::vector<T> &shadow, bool raw = false) {
+    const bool present =
+        current.size() != shadow.size() ||
+        (!current.empty() && std::memcmp(current.data(), shadow.data(),
+                                         current.size() * sizeof(T)) != 0);
+    w.write(delta_table{.present = present});
+    if (!present) {
+      return;
+    }
+
+    shadow.resize(current.size());
+    blob(w, reinterpret_cast<const std::byte *>(current.data()),
+         options_.xor_previous && !raw
+             ? reinterpret_cast<const std::byte *>(shadow.data())
+             : nullptr,
+         current.size() * sizeof(T));
+    shadow.assign(current.begin(), current.end());
+  }
+
+  // Appends to ranges_ the bytes of `c` the replica lacks.
+  void diff(const typename world_t::archetype &archetype, const chunk &c,
+            const shadow_chunk &shadow) {
+    const auto &layout = archetype.layout;
+    if (!c.allocated()) {
+      return;
+    }
+    // Chunks start with the change ticks, see basic_world::layout_of.
+    const auto ticks_size = archetype.types.count() * sizeof(change_ticks);
+    const auto whole = [&] {
+      ranges_.push_back({0, ticks_size, true});
+      ranges_.push_back({ticks_size, layout.chunk_size - ticks_size});
+    };
+    if (!shadow.allocated ||
+        !std::equal(shadow.occupied.begin(), shadow.occupied.end(),
+                    c.occupied.get())) {
+      whole();
+      return;
+    }
+
+    const auto first = ranges_.size();
+    archetype.types.for_each([&](std::size_t i) {
+      const auto &ticks = layout.columns[i].ticks_in(c.data.get());
+      if (ticks.changed > since_ || ticks.added > since_) {
+        ranges_.push_back({layout.columns[i].offset,
+                           layout.columns[i].size * layout.capacity});
+      }
+    });
+    if (ranges_.size() == first) {
+      return;
+    }
+
+    if (layout.mode == storage_mode::rows) {
+      ranges_.resize(first);
+      whole();
+      return;
+    }
+    // Entities move between rows of a chunk without changing its occupancy.
+    ranges_.push_back({0, ticks_size, true});
+    ranges_.push_back(
+        {layout.entities.offset, layout.entities.size * layout.capacity});
+  }
+
+public:
+  explicit delta_encoder(delta_options options = {}) : options_(options) {}
+
+  // Writes the next frame to `out`, no query may be iterating `world`
+  // meanwhile. Pending commands are not part of it.
+  void encode(world_t &world, std::ostream &out) {
+    // Changes made from now on have a later tick.
+    const auto now = world.tick_.fetch_add(1, std::memory_order_relaxed);
+    const auto sparse_sets = std::ranges::count_if(
+        world.sparse_sets_, [](const auto &set) { return set != nullptr; });
+
+    snapshot_writer w{out};
+    w.write(delta_header{
+        .magic = delta_header::expected_magic,
+        .version = delta_header::current_version,
+        .max_components = static_cast<std::uint32_t>(N),
+        .tick = world.tick(),
+        .entities = world.entities_.size(),
+        .free_entities = world.free_entities_.size(),
+        .archetypes = world.archetypes_.size(),
+        .sparse_sets = static_cast<std::uint64_t>(sparse_sets),
+        .flags = (options_.xor_previous ? delta_header::xor_previous : 0u) |
+                 (options_.zero_runs ? delta_header::zero_runs : 0u),
+    });
+    table<entity_location>(w, world.entities_, entities_);
+    table<std::uint32_t>(w, world.free_entities_, free_entities_);
+
+    for (auto a = chunks_.size(); a < world.archetypes_.size(); a++) {
+      const auto &archetype = world.archetypes_[a];
+      w.write(snapshot_archetype<N>{
+          .types = archetype.types.words(),
+          .layout = archetype.layout,
+          .dense = archetype.dense,
+          .chunks = 0,
+      });
+      chunks_.emplace_back();
+    }
+
+    for (std::size_t a = 0; a < world.archetypes_.size(); a++) {
+      const auto &archetype = world.archetypes_[a];
+      const auto &layout = archetype.layout;
+      const auto chunks = archetype.data.chunks();
+      auto &shadows = chunks_[a];
+      shadows.resize(chunks.size());
+
+      ranges_.clear();
+      changed_.clear();
+      for (std::size_t i = 0; i < chunks.size(); i++) {
+        const auto first = ranges_.size();
+        diff(archetype, chunks[i], shadows[i]);
+        if (ranges_.size() != first ||
+            chunks[i].allocated() != shadows[i].allocated) {
+          changed_.push_back({i, first, ranges_.size()});
+        }
+      }
+
+      w.write(delta_archetype{.chunks = chunks.size(),
+                              .changed = changed_.size()});
+      for (const auto &[index, first, last] : changed_) {
+        const auto &c = chunks[index];
+        auto &shadow = shadows[index];
+        w.write(delta_chunk{
+            .index = static_cast<std::uint32_t>(index),
+            .ranges = static_cast<std::uint32_t>(last - first),
+            .allocated = c.allocated(),
+        });
+
+        shadow.allocated = c.allocated();
+        if (!c.allocated()) {
+          shadow.occupied.clear();
+          shadow.data.clear();
+          continue;
+        }
+        shadow.occupied.assign(c.occupied.get(), c.occupied.get() + c.words());
+        w.write(std::span<const std::uint64_t>{shadow.occupied});
+        if (options_.xor_previous) {
+          // Released chunks restart from zeros on both ends.
+          shadow.data.resize(layout.chunk_size);
+        }
+
+        for (auto r = first; r < last; r++) {
+          const auto [offset, size, raw] = ranges_[r];
+          w.write(delta_range{.offset = offset, .size = size, .raw = raw});
+          const auto *data = c.data.get() + offset;
+          if (options_.xor_previous) {
+            blob(w, data, raw ? nullptr : shadow.data.data() + offset, size);
+            std::memcpy(shadow.data.data() + offset, data, size);
+          } else {
+            blob(w, data, nullptr, size);
+          }
+        }
+      }
+    }
+
+    for (std::size_t i = 0; i < N; i++) {
+      const auto *set = world.sparse_sets_[i].get();
+      if (set == nullptr) {
+        continue;
+      }
+      w.write(snapshot_sparse_set{
+          .type_index = i,
+          .size = set->component_size(),
+          .alignment = set->alignment(),
+          .count = set->size(),
+      });
+      table(w, set->entities(), sets_[i].entities);
+      table(w, set->all_ticks(), sets_[i].ticks, true);
+      table(w, set->bytes(), sets_[i].bytes);
+    }
+
+    since_ = now;
+  }
+};
+
+// Decodes the blob of `size` bytes at the position of `r` into `out`.
+inline void apply_delta_blob(snapshot_reader &r, std::uint32_t flags,
+                             std::byte *out, std::size_t size) {
+  const auto blob = r.read<delta_blob>();
+  if (blob.size != size) {
+    throw std::runtime_error("corrupt delta");
+  }
+  const auto *in = r.take(blob.encoded, 1);
+  const bool xor_previous = flags & delta_header::xor_previous;
+  const auto put = [&](std::size_t at, const std::byte *bytes,
+                       std::size_t n) {
+    if (xor_previous) {
+      for (std::size_t i = 0; i < n; i++) {
+        out[at + i] ^= bytes[i];
+      }
+    } else {
+      std::memcpy(out + at, bytes, n);
+    }
+  };
+
+  if (!(flags & delta_header::zero_runs)) {
+    if (blob.encoded != size) {
+      throw std::runtime_error("corrupt delta");
+    }
+    put(0, in, size);
+    return;
+  }
+
+  std::size_t at = 0;
+  for (std::size_t pos = 0; pos < blob.encoded;) {
+    std::array<std::uint32_t, 2> token;
+    if (blob.encoded - pos < sizeof(token)) {
+      throw std::runtime_error("corrupt delta");
+    }
+    std::memcpy(token.data(), in + pos, sizeof(token));
+    pos += sizeof(token);
+    const auto [zeros, literals] = token;
+    if (size - at < zeros || size - at - zeros < literals ||
+        blob.encoded - pos < literals) {
+      throw std::runtime_error("corrupt delta");
+    }
+    if (!xor_previous) {
+      std::memset(out + at, 0, zeros);
+    }
+    at += zeros;
+    put(at, in + pos, literals);
+    at += literals;
+    pos += literals;
+  }
+  if (at != size) {
+    throw std::runtime_error("corrupt delta");
+  }
+}
+
+// Applies a frame of a delta_encoder to `world`, see delta_encoder.
+template <class Registry>
+void apply_delta(basic_world<Registry> &world, std::span<std::byte> frame) {
+  constexpr auto N = Registry::max_components;
+  snapshot_reader r{frame};
+  const auto header = r.read<delta_header>();
+  if (header.magic != delta_header::expected_magic ||
+      header.version != delta_header::current_version) {
+    throw std::runtime_error("not a delta");
+  }
+  if (header.max_components != N ||
+      header.archetypes < world.archetypes_.size()) {
+    throw std::runtime_error("delta of another world");
+  }
+
+  // Raw blobs are never XORed.
+  const auto raw_flags = header.flags & ~delta_header::xor_previous;
+  const auto table = [&](auto &v, std::size_t size, bool raw = false) {
+    using T = std::remove_reference_t<decltype(v)>::value_type;
+    if (r.read<delta_table>().present == 0) {
+      return;
+    }
+    v.resize(size);
+    apply_delta_blob(r, raw ? raw_flags : header.flags,
+                     reinterpret_cast<std::byte *>(v.data()), size * sizeof(T));
+  };
+  table(world.entities_, header.entities);
+  table(world.free_entities_, header.free_entities);
+
+  for (auto a = world.archetypes_.size(); a < header.archetypes; a++) {
+    restore_archetype(world, r.read<snapshot_archetype<N>>());
+  }
+
+  for (auto &archetype : world.archetypes_) {
+    const auto &layout = archetype.layout;
+    const auto record = r.read<delta_archetype>();
+    // Chunks without storage are only sent when they lose it.
+    for (auto i = archetype.data.chunks().size(); i < record.chunks; i++) {
+      archetype.data.restore_chunk(i, {});
+    }
+    for (std::size_t i = 0; i < record.changed; i++) {
+      const auto c = r.read<delta_chunk>();
+      if (c.index >= record.chunks) {
+        throw std::runtime_error("corrupt delta");
+      }
+      if (c.allocated == 0) {
+        archetype.data.restore_chunk(c.index, {});
+        continue;
+      }
+
+      const auto occupied = r.read<std::uint64_t>((layout.capacity + 63) / 64);
+      const bool fresh = !archetype.data.chunks()[c.index].allocated();
+      auto &chunk = archetype.data.restore_chunk(c.index, occupied);
+      if (fresh && (header.flags & delta_header::xor_previous)) {
+        std::memset(chunk.data.get(), 0, layout.chunk_size);
+      }
+
+      for (std::uint32_t j = 0; j < c.ranges; j++) {
+        const auto range = r.read<delta_range>();
+        if (range.offset > layout.chunk_size ||
+            layout.chunk_size - range.offset < range.size) {
+          throw std::runtime_error("corrupt delta");
+        }
+        apply_delta_blob(r, range.raw != 0 ? raw_flags : header.flags,
+                         chunk.data.get() + range.offset, range.size);
+      }
+    }
+    if (record.chunks < archetype.data.chunks().size()) {
+      archetype.data.truncate(record.chunks);
+    }
+  }
+
+  for (std::size_t s = 0; s < header.sparse_sets; s++) {
+    const auto record = r.read<snapshot_sparse_set>();
+    auto &set = restored_sparse_set(world, record);
+    if (record.count > std::numeric_limits<std::uint32_t>::max()) {
+      throw std::runtime_error("corrupt delta");
+    }
+    std::vector<std::uint32_t> entities(set.entities().begin(),
+                                        set.entities().end());
+    std::vector<change_ticks> ticks(set.all_ticks().begin(),
+                                    set.all_ticks().end());
+    std::vector<std::byte> bytes(set.bytes().begin(), set.bytes().end());
+    table(entities, record.count);
+    table(ticks, record.count, true);
+    table(bytes, record.count * set.stride());
+    if (entities.size() != record.count || ticks.size() != record.count ||
+        bytes.size() != record.count * set.stride()) {
+      throw std::runtime_error("corrupt delta");
+    }
+    set.assign(entities, ticks, bytes);
+  }
+  check_entities(world, "corrupt delta");
+
+  world.tick_.store(header.tick, std::memory_order_relaxed);
+}
+
+} // namespace ecs
@@ -1,137 +1,935 @@
 #pragma once
 
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <bit>
-#include <bitset>
+#include <concepts>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
+#include <functional>
 #include <iterator>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <span>
 #include <tuple>
 #include <type_traits>
 #include <typeindex>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
+#include "commands.h"
 #include "hive.h"
 #include "nostd.h"
+#include "profiler.h"
+#include "thread_pool.h"
+#include "type_set.h"
 
 namespace ecs {
 
 enum class entity_t : uint64_t {};
 
 struct entity_info {
-  uint16_t generation;
-  uint16_t archetype;
-  hive_index_t idx;
+  uint32_t index;
+  // Bumped each time the entity of that index is despawned.
+  uint32_t generation;
 
-  entity_t into_entity_t() { return std::bit_cast<entity_t>(*this); }
+  entity_t into_entity_t() const { return std::bit_cast<entity_t>(*this); }
   static entity_info from_entity_t(entity_t ent) {
     return std::bit_cast<entity_info>(ent);
   }
 };
 
+// Where the entity of a given index is stored. Handles only hold the index,
+// so entities can move between and inside archetypes. Aligned on its size so
+// that resolving a handle reads a single cache line.
+struct alignas(16) entity_location {
+  uint32_t generation;
+  uint32_t archetype;
+  hive_index_t idx;
+};
+static_assert(sizeof(entity_location) == 16);
+
 template <class A, class Components>
 concept component = nostd::contains_v<A, Components>;
 
-struct type_info {
+// How archetypes lay their entities out inside hive chunks.
+enum class storage_mode {
+  // One packed row per entity, components next to each other.
+  rows,
+  // One contiguous column per component in each chunk.
+  columns,
+};
+
+// Last ticks at which a component of a chunk was given to one of its entities
+// and handed out to be written, see basic_world::tick.
+struct change_ticks {
+  std::uint64_t added;
+  std::uint64_t changed;
+};
+
+// Where a component lives in a chunk: the component of the entity at index i
+// of the chunk is at `offset + i * stride` from the chunk storage, its change
+// ticks at `ticks`.
+struct column_layout {
+  std::size_t offset;
+  std::size_t stride;
   std::size_t size;
-  std::size_t alignement;
+  std::size_t ticks;
+
+  std::byte *at(hive_slot slot) const {
+    return slot.data + offset + slot.index * stride;
+  }
+  change_ticks &ticks_in(std::byte *chunk_data) const {
+    return *reinterpret_cast<change_ticks *>(chunk_data + ticks);
+  }
+};
+
+// Where the components of a type live. Table components are part of the
+// archetype of their entity, which makes iterating them fast but giving or
+// taking one moves the entity to another archetype. Sparse set components are
+// kept aside, in one packed array per type: they are given and taken in O(1)
+// without moving the entity nor making archetypes, for the components toggled
+// at high frequency.
+enum class storage_policy {
+  table,
+  sparse_set,
+};
+
+// Components pick theirs with a `static constexpr ecs::storage_policy storage`
+// member, table by default. Can be specialized for the others.
+template <class T> struct storage_policy_of {
+  static constexpr storage_policy value = [] {
+    if constexpr (requires {
+                    { T::storage } -> std::convertible_to<storage_policy>;
+                  }) {
+      return storage_policy{T::storage};
+    } else {
+      return storage_policy::table;
+    }
+  }();
+};
+template <class T>
+inline constexpr bool is_sparse_v =
+    storage_policy_of<std::remove_const_t<T>>::value ==
+    storage_policy::sparse_set;
+
+// The components of one sparse set type, packed in the order they were given
+// along with their change ticks, and found through the entity index.
+class sparse_set {
+public:
+  static constexpr std::uint32_t npos = static_cast<std::uint32_t>(-1);
+
+  sparse_set(std::size_t size, std::size_t alignment)
+      : size_(size), stride_(nostd::align_up(size, alignment)),
+        data_(nullptr, aligned_delete{alignment}) {}
+
+  std::size_t size() const { return entities_.size(); }
+  std::size_t component_size() const { return size_; }
+  std::size_t alignment() const { return data_.get_deleter().alignment; }
+  std::size_t stride() const { return stride_; }
+
+  bool contains(std::uint32_t entity) const {
+    return entity < positions_.size() && positions_[entity] != npos;
+  }
+  // The component of `entity`, null if it has none.
+  std::byte *find(std::uint32_t entity) {
+    return contains(entity) ? at(positions_[entity]) : nullptr;
+  }
+  // `entity` must have a component.
+  change_ticks &ticks(std::uint32_t entity) {
+    assert(contains(entity));
+    return ticks_[positions_[entity]];
+  }
+
+  // The component of `entity`, uninitialized if it had none. Either way it is
+  // changed at `tick`.
+  std::byte *insert(std::uint32_t entity, std::uint64_t tick) {
+    if (contains(entity)) {
+      ticks_[positions_[entity]].changed = tick;
+      return at(positions_[entity]);
+    }
+    if (entity >= positions_.size()) {
+      positions_.resize(entity + 1, npos);
+    }
+    if (size() == capacity_) {
+      reserve(std::max<std::size_t>(2 * capacity_, 16));
+    }
+    positions_[entity] = static_cast<std::uint32_t>(size());
+    entities_.push_back(entity);
+    ticks_.push_back({.added = tick, .changed = tick});
+    return at(size() - 1);
+  }
+
+  // Takes the component of `entity` away, returns false if it had none. The
+  // last component fills the hole.
+  bool erase(std::uint32_t entity) {
+    if (!contains(entity)) {
+      return false;
+    }
+    const auto pos = positions_[entity];
+    const auto last = size() - 1;
+    if (pos != last) {
+      std::memcpy(at(pos), at(last), size_);
+      entities_[pos] = entities_[last];
+      ticks_[pos] = ticks_[last];
+      positions_[entities_[pos]] = pos;
+    }
+    entities_.pop_back();
+    ticks_.pop_back();
+    positions_[entity] = npos;
+    return true;
+  }
+
+  // The entity index, change ticks and component of each element, in order.
+  std::span<const std::uint32_t> entities() const { return entities_; }
+  std::span<const change_ticks> all_ticks() const { return ticks_; }
+  std::span<const std::byte> bytes() const {
+    return {data_.get(), size() * stride_};
+  }
+
+  // Replaces the elements by the `entities.size()` ones described the same
+  // way as by entities(), all_ticks() and bytes().
+  void assign(std::span<const std::uint32_t> entities,
+              std::span<const change_ticks> ticks,
+              std::span<const std::byte> bytes) {
+    assert(ticks.size() == entities.size());
+    assert(bytes.size() == entities.size() * stride_);
+    if (capacity_ < entities.size()) {
+      reserve(entities.size());
+    }
+    std::ranges::fill(positions_, npos);
+    entities_.assign(entities.begin(), entities.end());
+    ticks_.assign(ticks.begin(), ticks.end());
+    if (!bytes.empty()) {
+      std::memcpy(data_.get(), bytes.data(), bytes.size());
+    }
+    for (std::size_t pos = 0; pos < entities_.size(); pos++) {
+      if (entities_[pos] >= positions_.size()) {
+        positions_.resize(entities_[pos] + 1, npos);
+      }
+      positions_[entities_[pos]] = static_cast<std::uint32_t>(pos);
+    }
+  }
+
+private:
+  struct aligned_delete {
+    std::size_t alignment;
+    void operator()(std::byte *p) const {
+      ::operator delete[](p, std::align_val_t{alignment});
+    }
+  };
+
+  std::size_t size_;
+  std::size_t stride_;
+  std::size_t capacity_ = 0;
+  // Position of the component of each entity index, npos if none.
+  std::vector<std::uint32_t> positions_;
+  // Entity index of each position.
+  std::vector<std::uint32_t> entities_;
+  std::vector<change_ticks> ticks_;
+  std::unique_ptr<std::byte[], aligned_delete> data_;
+
+  std::byte *at(std::size_t pos) { return data_.get() + pos * stride_; }
+
+  void reserve(std::size_t capacity) {
+    std::unique_ptr<std::byte[], aligned_delete> data{
+        static_cast<std::byte *>(::operator new[](
+            capacity * stride_, std::align_val_t{alignment()})),
+        data_.get_deleter()};
+    if (size() != 0) {
+      std::memcpy(data.get(), data_.get(), size() * stride_);
+    }
+    data_ = std::move(data);
+    capacity_ = capacity;
+  }
+};
+
+template <const std::size_t N> struct archetype_layout {
+  storage_mode mode;
+  // Storage taken by a chunk, its alignment and the number of entities it
+  // holds.
+  std::size_t chunk_size;
+  std::size_t alignment;
+  std::size_t capacity;
+  // Indexed by registry type index, only meaningful for the archetype types.
+  std::array<column_layout, N> columns;
+  // Index of the entity owning each row, as a uint32_t.
+  column_layout entities;
+  // What the layout was made from, see basic_world::layout_of.
+  std::size_t column_alignment;
+  std::size_t chunk_bytes;
 };
 
 template <const std::size_t N> struct Archetype {
-  std::bitset<N> types;
-  type_info tinfo;
+  type_set<N> types;
+  archetype_layout<N> layout;
 
   hive data;
 
-  Archetype(std::bitset<N> types, type_info tinfo)
-      : types(types), tinfo(tinfo), data(tinfo.size) {}
+  // Archetypes reached by adding or removing a single component, keyed by
+  // the registry index of that component.
+  std::unordered_map<std::size_t, std::size_t> with_edges;
+  std::unordered_map<std::size_t, std::size_t> without_edges;
 
-  hive_index_t insert(std::span<const std::byte> src) {
-    auto [idx, d] = data.create();
-    std::copy(src.begin(), src.end(), d);
+  // Despawning moves the last entity in the hole so that chunks stay
+  // packed.
+  bool dense;
 
-    return idx;
+  Archetype(type_set<N> types, archetype_layout<N> layout, bool dense,
+            chunk_allocator *allocator)
+      : types(types), layout(layout),
+        data(layout.chunk_size, layout.alignment, layout.capacity, allocator),
+        dense(dense) {}
+
+  // The components `added` are the ones the entity did not have before.
+  std::pair<hive_index_t, hive_slot> create(std::uint32_t entity,
+                                            std::uint64_t tick,
+                                            type_set<N> added) {
+    const auto out = data.create();
+    set_entity(out.second, entity);
+    const auto info = hive_entry_info_t::from_hive_index(out.first);
+    if (data.chunks()[info.chunk].size == 1) {
+      // New chunk, its ticks are garbage.
+      touch(out.second, {}, types, 0);
+    }
+    touch(out.second, types, added, tick);
+    return out;
   }
 
-  std::span<std::byte> at(hive_index_t index) { return data.get(index); }
+  change_ticks &ticks(hive_slot slot, std::size_t type_index) {
+    return layout.columns[type_index].ticks_in(slot.data);
+  }
+  // Marks the components `changed` of the chunk of `slot` as changed at
+  // `tick`, and the components `added` as added.
+  void touch(hive_slot slot, type_set<N> changed, type_set<N> added,
+             std::uint64_t tick) {
+    changed.for_each([&](std::size_t i) { ticks(slot, i).changed = tick; });
+    added.for_each([&](std::size_t i) { ticks(slot, i).added = tick; });
+  }
+
+  // For the component `type_index` of an entity moved to `dst` from `src`
+  // of `from`: the chunk of `dst` passes Added filters at least when the one
+  // of `src` did, the entity may be the one the component was given to.
+  void carry_added(hive_slot dst, Archetype &from, hive_slot src,
+                   std::size_t type_index) {
+    auto &added = ticks(dst, type_index).added;
+    added = std::max(added, from.ticks(src, type_index).added);
+  }
 
-  auto begin() { return data.end(); }
-  auto end() { return data.begin(); }
+  std::uint32_t entity_at(hive_slot slot) const {
+    std::uint32_t entity;
+    std::memcpy(&entity, layout.entities.at(slot), sizeof(entity));
+    return entity;
+  }
+  void set_entity(hive_slot slot, std::uint32_t entity) {
+    std::memcpy(layout.entities.at(slot), &entity, sizeof(entity));
+  }
+
+  // Returns the index of the entity moved into `index`, if any.
+  std::optional<std::uint32_t> remove(hive_index_t index,
+                                      std::uint64_t tick) {
+    if (!dense) {
+      data.remove(index);
+      return std::nullopt;
+    }
+
+    const auto last = data.back();
+    std::optional<std::uint32_t> moved;
+    if (last != index) {
+      const auto src = data.get(last);
+      const auto dst = data.get(index);
+      types.for_each([&](std::size_t i) {
+        std::memcpy(at(dst, i), at(src, i), layout.columns[i].size);
+        carry_added(dst, *this, src, i);
+      });
+      moved = entity_at(src);
+      set_entity(dst, *moved);
+      touch(dst, types, {}, tick);
+    }
+    data.pop_back();
+    return moved;
+  }
+
+  hive_slot at(hive_index_t index) { return data.get(index); }
+  std::byte *at(hive_slot slot, std::size_t type_index) {
+    return layout.columns[type_index].at(slot);
+  }
+
+  auto begin() { return data.begin(); }
+  auto end() { return data.end(); }
 };
 
 template <class... Ts> struct entity_getter {
   static std::tuple<Ts &...>
-  from_data_offsets(std::byte *data,
-                    std::array<std::size_t, sizeof...(Ts)> offsets) {
+  from_slot(hive_slot slot,
+            const std::array<column_layout, sizeof...(Ts)> &columns) {
     std::size_t i = 0;
     return {
 
         ([&]() -> Ts & {
-          return (*reinterpret_cast<Ts *>(data + offsets[i++]));
+          return (*reinterpret_cast<Ts *>(columns[i++].at(slot)));
+        }())...,
+    };
+  }
+
+  // Same as from_slot for column storage, where the stride of a column is
+  // known to be sizeof(T).
+  static std::tuple<Ts &...>
+  from_columns(hive_slot slot,
+               const std::array<column_layout, sizeof...(Ts)> &columns) {
+    std::size_t i = 0;
+    return {
+
+        ([&]() -> Ts & {
+          return reinterpret_cast<Ts *>(slot.data +
+                                        columns[i++].offset)[slot.index];
         }())...,
     };
   }
 };
 template <class... Ts> struct entity_ptr_getter {
   static std::tuple<Ts *...>
-  from_data_offsets(std::byte *data,
-                    std::array<std::size_t, sizeof...(Ts)> offsets) {
+  from_slot(hive_slot slot,
+            const std::array<column_layout, sizeof...(Ts)> &columns) {
+    std::size_t i = 0;
+    return {
+
+        ([&]() -> Ts * {
+          return (reinterpret_cast<Ts *>(columns[i++].at(slot)));
+        }())...,
+    };
+  }
+
+  static std::tuple<Ts *...>
+  from_columns(hive_slot slot,
+               const std::array<column_layout, sizeof...(Ts)> &columns) {
     std::size_t i = 0;
     return {
 
         ([&]() -> Ts * {
-          return (reinterpret_cast<Ts *>(data + offsets[i++]));
+          return reinterpret_cast<Ts *>(slot.data + columns[i++].offset) +
+                 slot.index;
         }())...,
     };
   }
 };
-template <class World, class... Ts> class query_iterator {
-  using archetypes_vector_iterator =
-      std::vector<typename World::archetype>::iterator;
+template <const std::size_t K> struct archetype_columns {
+  std::array<column_layout, K> columns;
+  // Whether the archetype has the component, only false for Optional terms
+  // and sparse set components.
+  std::array<bool, K> present;
+  // Column storage, and no sparse set component is fetched.
+  bool contiguous;
+  column_layout entities;
+};
 
-  struct M {
-    typename World::type_set types;
-    archetypes_vector_iterator archetypes_vector_cur;
-    archetypes_vector_iterator archetypes_vector_end;
+// Query filters, matching the chunks whose component T was handed out to be
+// written (resp. given to one of their entities) since the previous run of the
+// same consumer, see basic_world::query. Filters match whole chunks: every
+// entity of a matched chunk is visited. They fetch nothing.
+template <class T> struct Changed {
+  using component = T;
+  static bool passes(const change_ticks &ticks, std::uint64_t since) {
+    return ticks.changed > since;
+  }
+};
+template <class T> struct Added {
+  using component = T;
+  static bool passes(const change_ticks &ticks, std::uint64_t since) {
+    return ticks.added > since;
+  }
+};
+
+template <class T>
+concept query_filter = requires(const change_ticks &ticks) {
+  typename T::component;
+  { T::passes(ticks, std::uint64_t{}) } -> std::same_as<bool>;
+};
+
+// Query terms resolved when matching archetypes: With<T> requires a T without
+// fetching it, Without<T> skips the archetypes that have one.
+template <class T> struct With {
+  using component = T;
+};
+template <class T> struct Without {
+  using component = T;
+};
+// Fetches a pointer to the T of the entity, null in the archetypes without
+// one. Chunks of those archetypes get an empty span.
+template <class T> struct Optional {
+  using component = T;
+};
+
+// How a query term matches archetypes and what it fetches: a plain
+// component is required and fetched. Components fetched as const are only
+// read: they are not marked as changed.
+template <class T> struct term_traits {
+  using component = std::remove_const_t<T>;
+  static constexpr bool fetched = true;
+  static constexpr bool required = true;
+  static constexpr bool excluded = false;
+  static constexpr bool writes = !std::is_const_v<T>;
+
+  using ref = T &;
+  using span_type = std::span<T>;
+  static ref deref(component *p) { return *p; }
+  static span_type as_span(component *p, std::size_t count) {
+    return {p, count};
+  }
+  static ref at(span_type s, std::size_t i) { return s[i]; }
+};
+template <query_filter T> struct term_traits<T> {
+  using component = std::remove_const_t<typename T::component>;
+  static constexpr bool fetched = false;
+  static constexpr bool required = true;
+  static constexpr bool excluded = false;
+  static constexpr bool writes = false;
+};
+template <class T> struct term_traits<With<T>> {
+  using component = std::remove_const_t<T>;
+  static constexpr bool fetched = false;
+  static constexpr bool required = true;
+  static constexpr bool excluded = false;
+  static constexpr bool writes = false;
+};
+template <class T> struct term_traits<Without<T>> {
+  using component = std::remove_const_t<T>;
+  static constexpr bool fetched = false;
+  static constexpr bool required = false;
+  static constexpr bool excluded = true;
+  static constexpr bool writes = false;
+};
+template <class T> struct term_traits<Optional<T>> {
+  using component = std::remove_const_t<T>;
+  static constexpr bool fetched = true;
+  static constexpr bool required = false;
+  static constexpr bool excluded = false;
+  static constexpr bool writes = !std::is_const_v<T>;
+
+  using ref = T *;
+  using span_type = std::span<T>;
+  static ref deref(component *p) { return p; }
+  static span_type as_span(component *p, std::size_t count) {
+    return p == nullptr ? span_type{} : span_type{p, count};
+  }
+  static ref at(span_type s, std::size_t i) {
+    return s.empty() ? nullptr : &s[i];
+  }
+};
+
+template <class T> using term_component_t = term_traits<T>::component;
+template <class T> using term_ref_t = term_traits<T>::ref;
+template <class T> using term_span_t = term_traits<T>::span_type;
+
+template <class T>
+struct is_query_filter : std::bool_constant<query_filter<T>> {};
+template <class T>
+struct is_query_fetch : std::bool_constant<term_traits<T>::fetched> {};
+template <class T>
+struct is_required_term : std::bool_constant<term_traits<T>::required> {};
+template <class T>
+struct is_excluded_term : std::bool_constant<term_traits<T>::excluded> {};
+template <class T>
+struct is_written_term : std::bool_constant<term_traits<T>::writes> {};
+// Of a sparse set component, see storage_policy.
+template <class T>
+struct is_sparse_term : std::bool_constant<is_sparse_v<term_component_t<T>>> {};
+template <class T>
+struct is_table_term : std::bool_constant<!is_sparse_v<term_component_t<T>>> {};
+// Fetched read-only, or filtered on its change ticks.
+template <class T>
+struct is_read_term
+    : std::bool_constant<(term_traits<T>::fetched && !term_traits<T>::writes) ||
+                         query_filter<T>> {};
+
+struct query_state_base {
+  virtual ~query_state_base() = default;
+};
+
+// What a query knows about the world: the archetypes it matches and where
+// its components are in them. Archetypes are never removed from a world, so
+// the state only has to look at the archetypes created since its last
+// update. Sparse set components take no part in matching archetypes, they are
+// checked for each entity of the matched ones.
+//
+// `Fetch` are the components handed out by the query, `Filter` its filters.
+template <class World, class Fetch, class Filter> struct query_state;
+template <class World, class... Ts, class... Fs>
+struct query_state<World, nostd::typelist<Ts...>, nostd::typelist<Fs...>>
+    : query_state_base {
+  struct match {
+    std::size_t archetype;
+    archetype_columns<sizeof...(Ts)> columns;
+    // Of the components of the filters, for their change ticks.
+    std::array<column_layout, sizeof...(Fs)> filters;
+  };
+
+  // Matched archetypes have all of `types` and none of `excluded`.
+  typename World::type_set types;
+  typename World::type_set excluded;
+  std::size_t seen = 0;
+  std::vector<match> matches;
 
-    hive_iterator archetype_cur;
-    hive_iterator archetype_end;
+  // Matched entities have a component in each of `required_sparse` and in
+  // none of `excluded_sparse`. Null for the terms of table components.
+  std::vector<sparse_set *> required_sparse;
+  std::vector<sparse_set *> excluded_sparse;
+  std::array<sparse_set *, sizeof...(Ts)> fetched_sparse{};
+  std::array<sparse_set *, sizeof...(Fs)> filtered_sparse{};
+  // Whether entities are checked one by one.
+  bool sparse = false;
+
+  query_state(World &world, typename World::type_set required,
+              typename World::type_set excluded)
+      : types(required & ~world.sparse_types()),
+        excluded(excluded & ~world.sparse_types()) {
+    const auto sparse_types = world.sparse_types();
+    for (std::size_t i = 0; i < sparse_types.size(); i++) {
+      if (sparse_types.test(i) && required.test(i)) {
+        required_sparse.push_back(&world.sparse_set_of(i));
+      }
+      if (sparse_types.test(i) && excluded.test(i)) {
+        excluded_sparse.push_back(&world.sparse_set_of(i));
+      }
+    }
+    const auto of = [&]<class T>() -> sparse_set * {
+      return is_sparse_v<T> ? &world.sparse_set_of(
+                                  world.registry.template index<T>())
+                            : nullptr;
+    };
+    fetched_sparse = {of.template operator()<term_component_t<Ts>>()...};
+    filtered_sparse = {of.template operator()<typename Fs::component>()...};
+    sparse = !required_sparse.empty() || !excluded_sparse.empty() ||
+             (is_sparse_term<Ts>::value || ...);
+  }
+
+  void update(World &world) {
+    const std::span<const typename World::type_set> unseen =
+        std::span{world.archetype_types_}.subspan(seen);
+    match_type_sets(unseen, types, excluded, [&](std::size_t i) {
+      const auto index = seen + i;
+      const auto &archetype = world.archetypes_[index];
+      matches.push_back({
+          .archetype = index,
+          .columns =
+              {
+                  .columns = {archetype.layout.columns
+                                  [world.registry.template index<
+                                      term_component_t<Ts>>()]...},
+                  .present = {archetype.types.test(
+                      world.registry
+                          .template index<term_component_t<Ts>>())...},
+                  .contiguous =
+                      archetype.layout.mode == storage_mode::columns &&
+                      !(is_sparse_term<Ts>::value || ...),
+                  .entities = archetype.layout.entities,
+              },
+          .filters = {archetype.layout.columns
+                          [world.registry
+                               .template index<typename Fs::component>()]...},
+      });
+    });
+    seen = world.archetypes_.size();
+  }
+};
+
+template <class World, class Fetch, class Filter> class query_iterator;
+template <class World, class... Ts, class... Fs>
+class query_iterator<World, nostd::typelist<Ts...>, nostd::typelist<Fs...>> {
+  using state = query_state<World, nostd::typelist<Ts...>,
+                            nostd::typelist<Fs...>>;
+  using match = state::match;
+
+  struct M {
+    const state *st;
+    std::span<const match> matches;
+    const match *match_cur;
+    std::size_t chunk_cur;
+    chunk *chunk_ptr;
+    std::size_t item_cur;
 
-    std::array<std::size_t, sizeof...(Ts)> offsets;
     World *world;
+    // Chunks changed after `since` pass the filters, the components handed
+    // out are changed at `now`.
+    std::uint64_t since;
+    std::uint64_t now;
+    // When the query was made, in profiler::now() ticks.
+    std::uint64_t started;
 
     friend inline auto operator==(const M &a, const M &b) {
-      return a.archetype_cur == b.archetype_cur;
+      return a.match_cur == b.match_cur && a.chunk_cur == b.chunk_cur &&
+             a.item_cur == b.item_cur;
     }
   } m;
 
   query_iterator(M m) : m(m) {}
 
-public:
-  void find_next_archetype() {
-    while (m.archetypes_vector_cur != m.archetypes_vector_end &&
-           (m.archetypes_vector_cur->types & m.types) != m.types) {
-      ++m.archetypes_vector_cur;
+  // Entities [begin, end) of a chunk.
+  struct chunk_range {
+    const archetype_columns<sizeof...(Ts)> *columns;
+    chunk *c;
+    std::size_t begin;
+    std::size_t end;
+  };
+
+  auto &archetype_of(const match &match) {
+    return m.world->archetypes_[match.archetype];
+  }
+
+  // Under which the chunk visits are profiled.
+  static const char *name() {
+    static const char *const n =
+        nostd::type_name<nostd::typelist<Ts..., Fs...>>();
+    return n;
+  }
+
+  // Records the iteration from the making of the query to its end, as a
+  // scope opened by the caller would be.
+  void record_run() const {
+#ifndef ECS_PROFILE_DISABLE
+    auto &p = profiler::global();
+    if (p.enabled()) {
+      p.record({
+          .name = name(),
+          .begin = m.started,
+          .end = profiler::now(),
+          .depth = profiler::depth(),
+      });
     }
-    if (m.archetypes_vector_cur == m.archetypes_vector_end) {
-      *this = end();
+#endif
+  }
+
+  // Whether the chunk has entities and passes the filters on table
+  // components.
+  bool selects(const match &match, chunk &c) const {
+    if (c.size == 0) {
+      return false;
+    }
+    return [&]<std::size_t... I>(std::index_sequence<I...>) {
+      return ((is_sparse_v<typename Fs::component> ||
+               Fs::passes(match.filters[I].ticks_in(c.data.get()), m.since)) &&
+              ...);
+    }(std::index_sequence_for<Fs...>{});
+  }
+
+  static std::uint32_t
+  entity_at(const archetype_columns<sizeof...(Ts)> &columns, hive_slot slot) {
+    std::uint32_t entity;
+    std::memcpy(&entity, columns.entities.at(slot), sizeof(entity));
+    return entity;
+  }
+
+  // Whether the entity at `index` of the chunk passes the terms on sparse set
+  // components.
+  bool accepts(const archetype_columns<sizeof...(Ts)> &columns, chunk &c,
+               std::size_t index) const {
+    const auto entity =
+        entity_at(columns, c.slot(static_cast<std::uint32_t>(index)));
+    for (const auto *s : m.st->required_sparse) {
+      if (!s->contains(entity)) {
+        return false;
+      }
+    }
+    for (const auto *s : m.st->excluded_sparse) {
+      if (s->contains(entity)) {
+        return false;
+      }
+    }
+    return [&]<std::size_t... I>(std::index_sequence<I...>) {
+      return ((!is_sparse_v<typename Fs::component> ||
+               Fs::passes(m.st->filtered_sparse[I]->ticks(entity), m.since)) &&
+              ...);
+    }(std::index_sequence_for<Fs...>{});
+  }
+
+  // First live entity of the chunk from `from` passing the sparse set terms,
+  // `top` if none.
+  std::size_t next_item(const match &match, chunk &c, std::size_t from) const {
+    auto i = c.next_live(from);
+    if (!m.st->sparse) {
+      return i;
+    }
+    while (i < c.top && !accepts(match.columns, c, i)) {
+      i = c.next_live(i + 1);
+    }
+    return i;
+  }
+  // Marks the components handed out for writing from the chunk as changed.
+  void touch(const match &match, chunk &c) const {
+    static constexpr std::array<bool, sizeof...(Ts)> writes = {
+        term_traits<Ts>::writes...,
+    };
+    for (std::size_t i = 0; i < sizeof...(Ts); i++) {
+      if (writes[i] && match.columns.present[i]) {
+        match.columns.columns[i].ticks_in(c.data.get()).changed = m.now;
+      }
+    }
+  }
+
+  // The fetched components of `slot`, null for the Optional ones the entity
+  // does not have. Sparse set components handed out for writing are changed.
+  std::tuple<term_component_t<Ts> *...>
+  pointers(hive_slot slot,
+           const archetype_columns<sizeof...(Ts)> &columns) const {
+    if constexpr (sizeof...(Ts) == 0) {
+      return {};
+    } else {
+      auto ptrs =
+          columns.contiguous
+              ? entity_ptr_getter<term_component_t<Ts>...>::from_columns(
+                    slot, columns.columns)
+              : entity_ptr_getter<term_component_t<Ts>...>::from_slot(
+                    slot, columns.columns);
+      std::size_t i = 0;
+      std::apply(
+          [&](auto *&...p) {
+            ((p = term_traits<Ts>::required || columns.present[i] ? p : nullptr,
+              i++),
+             ...);
+          },
+          ptrs);
+      if constexpr ((is_sparse_term<Ts>::value || ...)) {
+        const auto entity = entity_at(columns, slot);
+        [&]<std::size_t... I>(std::index_sequence<I...>) {
+          ((std::get<I>(ptrs) = is_sparse_term<Ts>::value
+                                    ? sparse_pointer<Ts>(I, entity)
+                                    : std::get<I>(ptrs)),
+           ...);
+        }(std::index_sequence_for<Ts...>{});
+      }
+      return ptrs;
+    }
+  }
+
+  template <class T>
+  term_component_t<T> *sparse_pointer(std::size_t i,
+                                      std::uint32_t entity) const {
+    auto *s = m.st->fetched_sparse[i];
+    auto *p = s->find(entity);
+    if (term_traits<T>::writes && p != nullptr) {
+      s->ticks(entity).changed = m.now;
+    }
+    return reinterpret_cast<term_component_t<T> *>(p);
+  }
+
+  // Calls `fn(count, spans...)` for the runs of contiguous entities of the
+  // range.
+  template <class Fn> void visit(const chunk_range &range, Fn &fn) const {
+    const auto call = [&](std::size_t index, std::size_t count) {
+      std::apply(
+          [&](term_component_t<Ts> *...ptrs) {
+            fn(count, term_traits<Ts>::as_span(ptrs, count)...);
+          },
+          pointers(range.c->slot(static_cast<std::uint32_t>(index)),
+                   *range.columns));
+    };
+
+    if (range.begin == range.end) {
+      return;
+    }
+    if (m.st->sparse) {
+      // Runs of entities passing the sparse set terms.
+      for (auto i = range.begin; i < range.end;) {
+        if (!accepts(*range.columns, *range.c, i)) {
+          i++;
+          continue;
+        }
+        auto j = i + 1;
+        while (range.columns->contiguous && j < range.end &&
+               accepts(*range.columns, *range.c, j)) {
+          j++;
+        }
+        call(i, j - i);
+        i = j;
+      }
       return;
     }
+    if (range.columns->contiguous) {
+      call(range.begin, range.end - range.begin);
+      return;
+    }
+    for (auto i = range.begin; i < range.end; i++) {
+      call(i, 1);
+    }
+  }
+
+  // Visits the matched chunks in jobs of about `grain` entities run on
+  // `pool`, see visit.
+  template <class Fn>
+  void par_visit(Fn &&fn, std::size_t grain, thread_pool &pool) {
+    ECS_PROFILE_SCOPE(name());
+    assert(grain > 0);
+    std::vector<chunk_range> ranges;
+    // ranges[jobs[i]] up to ranges[jobs[i + 1]] make the ith job.
+    std::vector<std::size_t> jobs;
+    std::size_t job_size = grain;
+    for (const auto &match : m.matches) {
+      for (auto &c : archetype_of(match).data.chunks()) {
+        if (!selects(match, c)) {
+          continue;
+        }
+        touch(match, c);
+        c.for_each_run([&](std::size_t run_begin, std::size_t run_end) {
+          for (auto begin = run_begin; begin < run_end; begin += grain) {
+            const auto end = std::min(begin + grain, run_end);
+            if (job_size >= grain) {
+              jobs.push_back(ranges.size());
+              job_size = 0;
+            }
+            ranges.push_back({&match.columns, &c, begin, end});
+            job_size += end - begin;
+          }
+        });
+      }
+    }
+    jobs.push_back(ranges.size());
+
+    pool.parallel_for(jobs.size() - 1, [&](std::size_t job) {
+      for (auto i = jobs[job]; i < jobs[job + 1]; i++) {
+        visit(ranges[i], fn);
+      }
+    });
+  }
 
-    m.offsets = {
-        m.world->template offset_in<Ts>(m.archetypes_vector_cur->types)...};
-    m.archetype_cur = m.archetypes_vector_cur->begin();
-    m.archetype_end = m.archetypes_vector_cur->end();
+public:
+  // Moves to the first live entity of the first selected chunk, starting
+  // from the current one.
+  void find_next_chunk() {
+    const auto *match_end = m.matches.data() + m.matches.size();
+    for (; m.match_cur != match_end; ++m.match_cur, m.chunk_cur = 0) {
+      const auto chunks = archetype_of(*m.match_cur).data.chunks();
+      for (; m.chunk_cur < chunks.size(); m.chunk_cur++) {
+        auto &c = chunks[m.chunk_cur];
+        if (!selects(*m.match_cur, c)) {
+          continue;
+        }
+        m.item_cur = next_item(*m.match_cur, c, 0);
+        if (m.item_cur != c.top) {
+          touch(*m.match_cur, c);
+          m.chunk_ptr = &c;
+          return;
+        }
+      }
+    }
+    *this = end();
   }
 
   query_iterator &operator++() {
-    ++m.archetype_cur;
-    if (m.archetype_cur != m.archetype_end) {
+    m.item_cur = next_item(*m.match_cur, *m.chunk_ptr, m.item_cur + 1);
+    if (m.item_cur != m.chunk_ptr->top) {
       return *this;
     }
 
-    ++m.archetypes_vector_cur;
-    find_next_archetype();
+    ++m.chunk_cur;
+    find_next_chunk();
+    if (m.chunk_ptr == nullptr) {
+      record_run();
+    }
     return *this;
   }
 
@@ -141,13 +939,82 @@ public:
     return out;
   }
 
-  inline std::tuple<Ts &...> operator*() { return next(); }
-  inline std::tuple<Ts &...> next() {
-    return entity_getter<Ts...>::from_data_offsets(*m.archetype_cur, m.offsets);
+  inline std::tuple<term_ref_t<Ts>...> operator*() { return next(); }
+  inline std::tuple<term_ref_t<Ts>...> next() {
+    return std::apply(
+        [](term_component_t<Ts> *...ptrs) {
+          return std::tuple<term_ref_t<Ts>...>{
+              term_traits<Ts>::deref(ptrs)...};
+        },
+        next_ptr());
+  }
+  inline std::tuple<term_component_t<Ts> *...> next_ptr() {
+    return pointers(m.chunk_ptr->slot(static_cast<std::uint32_t>(m.item_cur)),
+                    m.match_cur->columns);
+  }
+
+  // Number of entities the query visits.
+  std::size_t count() {
+    std::size_t n = 0;
+    for (const auto &match : m.matches) {
+      for (auto &c : archetype_of(match).data.chunks()) {
+        if (!selects(match, c)) {
+          continue;
+        }
+        if (!m.st->sparse) {
+          n += c.size;
+          continue;
+        }
+        for (auto i = c.next_live(0); i < c.top; i = c.next_live(i + 1)) {
+          n += accepts(match.columns, c, i);
+        }
+      }
+    }
+    return n;
   }
-  inline std::tuple<Ts *...> next_ptr() {
-    return entity_ptr_getter<Ts...>::from_data_offsets(*m.archetype_cur,
-                                                       m.offsets);
+
+  // Calls `fn(std::span<T>...)` (`std::span<const T>` for const terms) for
+  // every run of live entities in the chunks of the matched archetypes, so
+  // that kernels can be written as plain loops over contiguous memory.
+  // Archetypes using packed rows have no contiguous columns: they are handed
+  // over one entity at a time.
+  template <class Fn> void for_each_chunk(Fn &&fn) {
+    ECS_PROFILE_SCOPE(name());
+    const auto call = [&](std::size_t, auto... spans) { fn(spans...); };
+    for (const auto &match : m.matches) {
+      for (auto &c : archetype_of(match).data.chunks()) {
+        if (!selects(match, c)) {
+          continue;
+        }
+        touch(match, c);
+        c.for_each_run([&](std::size_t begin, std::size_t end) {
+          visit({&match.columns, &c, begin, end}, call);
+        });
+      }
+    }
+  }
+
+  // Same as for_each_chunk, but the matched chunks are split into jobs of
+  // about `grain` entities run on `pool`. `fn` is called concurrently.
+  template <class Fn>
+  void par_for_each_chunk(Fn &&fn,
+                          std::size_t grain = hive::default_chunk_capacity,
+                          thread_pool &pool = thread_pool::global()) {
+    par_visit([&](std::size_t, auto... spans) { fn(spans...); }, grain, pool);
+  }
+
+  // Calls `fn(T &...)` (`T *` for Optional terms, const for const terms) for
+  // every matched entity, in parallel.
+  template <class Fn>
+  void par_for_each(Fn &&fn, std::size_t grain = hive::default_chunk_capacity,
+                    thread_pool &pool = thread_pool::global()) {
+    par_visit(
+        [&](std::size_t count, term_span_t<Ts>... spans) {
+          for (std::size_t i = 0; i < count; i++) {
+            fn(term_traits<Ts>::at(spans, i)...);
+          }
+        },
+        grain, pool);
   }
 
   friend auto operator<=>(const query_iterator &a,
@@ -156,19 +1023,34 @@ public:
   query_iterator begin() { return *this; }
   query_iterator end() {
     return M{
-        m.types, m.archetypes_vector_end, m.archetypes_vector_end, {}, {}, {},
-        m.world,
+        .st = m.st,
+        .matches = m.matches,
+        .match_cur = m.matches.data() + m.matches.size(),
+        .chunk_cur = 0,
+        .chunk_ptr = nullptr,
+        .item_cur = 0,
+        .world = m.world,
+        .since = m.since,
+        .now = m.now,
+        .started = m.started,
     };
   }
 
-  query_iterator(World *world)
+  query_iterator(World *world, const state &state, std::uint64_t since,
+                 std::uint64_t now)
       : m{
-            .types = world->template as_type_set<Ts...>(),
-            .archetypes_vector_cur = world->archetypes_.begin(),
-            .archetypes_vector_end = world->archetypes_.end(),
+            .st = &state,
+            .matches = state.matches,
+            .match_cur = state.matches.data(),
+            .chunk_cur = 0,
+            .chunk_ptr = nullptr,
+            .item_cur = 0,
             .world = world,
+            .since = since,
+            .now = now,
+            .started = profiler::now(),
         } {
-    find_next_archetype();
+    find_next_chunk();
   }
 };
 
@@ -178,128 +1060,1026 @@ template <nostd::trivial... Cs> struct StaticRegistry {
   static constexpr std::array sizes = {
       sizeof(Cs)...,
   };
+  static constexpr std::array alignments = {
+      alignof(Cs)...,
+  };
+  static constexpr std::array storages = {
+      storage_policy_of<Cs>::value...,
+  };
 
-  constexpr std::size_t size(std::size_t type_index) const {
+  static constexpr std::size_t size(std::size_t type_index) {
     return sizes[type_index];
   }
+  static constexpr std::size_t alignment(std::size_t type_index) {
+    return alignments[type_index];
+  }
+  static constexpr storage_policy storage(std::size_t type_index) {
+    return storages[type_index];
+  }
+  // Number of components, the valid type indices are below it.
+  static constexpr std::size_t count() { return max_components; }
 
-  template <component<components_t> T> constexpr std::size_t index() {
+  template <component<components_t> T> static constexpr std::size_t index() {
     return nostd::index_of_v<T, components_t>;
   }
 };
 
+// Registries whose components are all known at compile time.
+template <class Registry>
+concept static_registry = requires { typename Registry::components_t; };
+
+// Numbers the types looked up in dynamic registries from 0, in the order
+// they are first looked up in the process.
+inline std::size_t next_type_id() {
+  static std::atomic<std::size_t> next = 0;
+  return next++;
+}
+template <class T> std::size_t type_id() {
+  static const std::size_t id = next_type_id();
+  return id;
+}
+
+// Components are given indices in the order they are registered, looked up
+// through their type_id in O(1). Lookups can run concurrently, e.g. from
+// systems recording commands: registering takes a lock, finding a registered
+// type does not. The type_id of the types must be below max_type_ids.
 template <const std::size_t N> struct DynamicRegistry {
   static constexpr std::size_t max_components = N;
+  static constexpr std::size_t max_type_ids = 1024;
   struct RegistryEntry {
     std::type_index type_idx;
     size_t size;
+    size_t alignment;
+    storage_policy storage;
   };
+  // Only grows, under `mutex`. An entry is written before its index is
+  // published in `indices`.
   nostd::stack_vector<RegistryEntry, N> entries{};
+  // One past the index of each type_id, 0 for the types not registered.
+  std::array<std::atomic<std::uint32_t>, max_type_ids> indices{};
+  std::atomic<std::uint32_t> registered = 0;
+  std::mutex mutex;
 
   std::size_t size(std::size_t idx) const { return entries[idx].size; }
+  std::size_t alignment(std::size_t idx) const {
+    return entries[idx].alignment;
+  }
+  // Table for the indices no type was registered at.
+  storage_policy storage(std::size_t idx) const {
+    return idx < count() ? entries[idx].storage : storage_policy::table;
+  }
+  // Number of registered components, the valid type indices are below it.
+  std::size_t count() const {
+    return registered.load(std::memory_order_acquire);
+  }
 
-  template <class T> std::size_t index() { return register_type<T>(); }
+  template <class T> std::size_t index() {
+    const auto id = type_id<T>();
+    assert(id < max_type_ids);
+    if (const auto i = indices[id].load(std::memory_order_acquire); i != 0) {
+      return i - 1;
+    }
+    return register_type<T>();
+  }
 
   template <class T> std::size_t register_type() {
-    const std::type_index key(typeid(T));
-    if (const auto it =
-            std::ranges::find(entries, key, &RegistryEntry::type_idx);
-        it != entries.end()) {
-      return std::distance(entries.begin(), it);
+    const auto id = type_id<T>();
+    assert(id < max_type_ids);
+    std::scoped_lock lock{mutex};
+    if (const auto i = indices[id].load(std::memory_order_relaxed); i != 0) {
+      return i - 1;
     }
 
     assert(entries.size() < N);
-    entries.push_back({key, sizeof(T)});
-    return entries.size() - 1;
+    const auto idx = entries.size();
+    entries.push_back({
+        .type_idx = typeid(T),
+        .size = sizeof(T),
+        .alignment = alignof(T),
+        .storage = storage_policy_of<T>::value,
+    });
+    registered.store(static_cast<std::uint32_t>(idx + 1),
+                     std::memory_order_release);
+    indices[id].store(static_cast<std::uint32_t>(idx + 1),
+                      std::memory_order_release);
+    return idx;
   }
 };
 
 template <class Registry> class basic_world {
 public:
-  using type_set = std::bitset<Registry::max_components>;
+  using type_set = ecs::type_set<Registry::max_components>;
   using archetype = Archetype<Registry::max_components>;
   Registry registry;
 
+  // The chunks of the world come from `allocator`, which must outlive it.
+  explicit basic_world(
+      chunk_allocator &allocator = heap_chunk_allocator::instance())
+      : allocator_(&allocator) {}
+  basic_world(const basic_world &) = delete;
+  basic_world &operator=(const basic_world &) = delete;
+
+  // The terms `Ts` of a query are the components it hands out, plain or
+  // Optional, and its filters, see term_traits.
+  template <class... Ts>
+  using query_state_t =
+      query_state<basic_world,
+                  nostd::filter_t<is_query_fetch, nostd::typelist<Ts...>>,
+                  nostd::filter_t<is_query_filter, nostd::typelist<Ts...>>>;
+  template <class... Ts>
+  using query_iterator_t =
+      query_iterator<basic_world,
+                     nostd::filter_t<is_query_fetch, nostd::typelist<Ts...>>,
+                     nostd::filter_t<is_query_filter, nostd::typelist<Ts...>>>;
+
+  // Each run of a query happens at a new tick, the components it hands out
+  // are changed at the tick of the run. Its filters are relative to
+  // `last_run`, the tick of the previous run by the same consumer or 0, which
+  // is set to the tick of this run: each system keeps its own so that none
+  // misses the changes another one already saw.
+  //
+  // Runs are profiled under the name of their terms: for_each_chunk and the
+  // parallel visits for the whole call, range-for loops from the making of
+  // the query until the iterator reaches the end. Loops left early and loops
+  // over no entity are not recorded.
+  template <class... Ts> auto query(std::uint64_t &last_run) {
+    auto &state = query_state_of<Ts...>();
+    const auto now = tick_.fetch_add(1, std::memory_order_relaxed);
+    const auto since = std::exchange(last_run, now);
+    return query_iterator_t<Ts...>{this, state, since, now};
+  }
   template <class... Ts> auto query() {
-    return query_iterator<basic_world, Ts...>{
-        this,
-    };
+    static_assert(!(is_query_filter<Ts>::value || ...),
+                  "filters need the last run of their consumer");
+    std::uint64_t last_run = 0;
+    return query<Ts...>(last_run);
   }
 
-  template <class... Ts> auto entity(const entity_t ent) {
+  // The state of the query is kept by the world and brought up to date with
+  // the archetypes created since it was last used.
+  template <class... Ts> query_state_t<Ts...> &query_state_of() {
+    static const std::size_t id = next_query_id();
+
+    std::scoped_lock lock{queries_mutex_};
+    if (id >= queries_.size()) {
+      queries_.resize(id + 1);
+    }
+    auto &q = queries_[id];
+    if (!q) {
+      q = std::make_unique<query_state_t<Ts...>>(
+          *this,
+          components_of(
+              nostd::filter_t<is_required_term, nostd::typelist<Ts...>>{}),
+          components_of(
+              nostd::filter_t<is_excluded_term, nostd::typelist<Ts...>>{}));
+    }
+
+    auto &state = static_cast<query_state_t<Ts...> &>(*q);
+    state.update(*this);
+    return state;
+  }
+
+  // Components a query of terms `Ts` reads and writes, to describe systems
+  // to the scheduler. Filters on change ticks read their component.
+  template <class... Ts> type_set reads_of() {
+    return components_of(
+        nostd::filter_t<is_read_term, nostd::typelist<Ts...>>{});
+  }
+  template <class... Ts> type_set writes_of() {
+    return components_of(
+        nostd::filter_t<is_written_term, nostd::typelist<Ts...>>{});
+  }
+
+  // Components changed outside of queries are changed at the current tick.
+  std::uint64_t tick() const { return tick_.load(std::memory_order_relaxed); }
+
+  // Components stored in sparse sets rather than in archetypes.
+  type_set sparse_types() const {
+    type_set types;
+    for (std::size_t i = 0; i < Registry::max_components; i++) {
+      types.set(i, registry.storage(i) == storage_policy::sparse_set);
+    }
+    return types;
+  }
+
+  // The sparse set of the component `type_index`, created on first use.
+  sparse_set &sparse_set_of(std::size_t type_index) {
+    auto &set = sparse_sets_[type_index];
+    if (!set) {
+      assert(registry.storage(type_index) == storage_policy::sparse_set);
+      set = std::make_unique<sparse_set>(registry.size(type_index),
+                                         registry.alignment(type_index));
+    }
+    return *set;
+  }
+
+  // Whether `ent` was not despawned.
+  bool alive(const entity_t ent) const {
     const auto ent_info = entity_info::from_entity_t(ent);
+    return ent_info.index < entities_.size() &&
+           entities_[ent_info.index].generation == ent_info.generation;
+  }
 
-    auto &archetype = archetypes_[ent_info.archetype];
-    const auto needed = as_type_set<Ts...>();
+  // Components asked for as const are not marked as changed.
+  template <class... Ts> auto entity(const entity_t ent) {
+    assert(alive(ent));
+    const auto index = entity_info::from_entity_t(ent).index;
+    const auto &location = entities_[index];
+
+    auto &archetype = archetypes_[location.archetype];
+    [[maybe_unused]] const auto needed =
+        components_of(nostd::filter_t<is_table_term, nostd::typelist<Ts...>>{});
     assert((needed & archetype.types) == needed);
 
-    return entity_getter<Ts...>::from_data_offsets(
-        archetype.at(ent_info.idx).data(),
-        {
-            offset_in<Ts>(archetype.types)...,
-        });
+    const auto slot = archetype.at(location.idx);
+    archetype.touch(slot, writes_of<Ts...>() & archetype.types, {}, tick());
+    if constexpr ((is_sparse_v<Ts> || ...)) {
+      return std::tuple<Ts &...>{component_of<Ts>(archetype, slot, index)...};
+    } else {
+      const std::array<column_layout, sizeof...(Ts)> columns = {
+          archetype.layout.columns
+              [registry.template index<std::remove_const_t<Ts>>()]...,
+      };
+      return archetype.layout.mode == storage_mode::columns
+                 ? entity_getter<Ts...>::from_columns(slot, columns)
+                 : entity_getter<Ts...>::from_slot(slot, columns);
+    }
   }
 
   template <class... Ts> entity_t insert(Ts &&...ts) {
-    constexpr std::size_t N = sizeof(std::tuple<Ts...>);
-    std::array<std::byte, N> data;
-    auto types = as_type_set<std::remove_cvref_t<Ts>...>();
-
-    (
-        [&] {
-          const auto &src =
-              std::span(reinterpret_cast<const std::byte *>(&ts), sizeof(Ts));
-          std::copy(src.begin(), src.end(),
-                    data.begin() + offset_in<std::remove_cvref_t<Ts>>(types));
-        }(),
-        ...);
-
-    const std::size_t archetype_idx = find_or_insert_archetype_idx(
-        types, {sizeof(data), alignof(decltype(data))});
+    const auto types = components_of(
+        nostd::filter_t<is_table_term,
+                        nostd::typelist<std::remove_cvref_t<Ts>...>>{});
+    const std::size_t archetype_idx = find_or_insert_archetype_idx(types);
 
     auto &archetype = archetypes_[archetype_idx];
-    const auto idx = archetype.insert(data);
+    const auto ent = new_entity();
+    const auto index = entity_info::from_entity_t(ent).index;
+    const auto [idx, slot] = archetype.create(index, tick(), types);
+    (std::memcpy(storage_of<std::remove_cvref_t<Ts>>(archetype, slot, index),
+                 &ts, sizeof(Ts)),
+     ...);
+
+    place(ent, archetype_idx, idx);
+    return ent;
+  }
+
+  // Destroys `ent`, returns false if it already was.
+  bool despawn(const entity_t ent) {
+    if (!alive(ent)) {
+      return false;
+    }
+
+    const auto index = entity_info::from_entity_t(ent).index;
+    auto &location = entities_[index];
+    if (const auto moved =
+            archetypes_[location.archetype].remove(location.idx, tick())) {
+      entities_[*moved].idx = location.idx;
+    }
+    for (auto &set : sparse_sets_) {
+      if (set) {
+        set->erase(index);
+      }
+    }
+    // An index whose generation would wrap is retired, so that no handle to
+    // one of its past entities comes back to life.
+    if (++location.generation != max_generation) {
+      free_entities_.push_back(index);
+    }
+    return true;
+  }
+
+  template <class T> bool has(const entity_t ent) {
+    assert(alive(ent));
+    const auto index = entity_info::from_entity_t(ent).index;
+    if constexpr (is_sparse_v<T>) {
+      return sparse_set_of(registry.template index<T>()).contains(index);
+    } else {
+      return archetypes_[entities_[index].archetype].types.test(
+          registry.template index<T>());
+    }
+  }
+
+  // Gives `ent` the component `T`, moving it to the archetype with `T` unless
+  // it is a sparse set component. If `ent` already has a `T` it is
+  // overwritten.
+  template <class T> void add(const entity_t ent, const T &value) {
+    assert(alive(ent));
+    const auto index = entity_info::from_entity_t(ent).index;
+    const auto type_index = registry.template index<T>();
+    const auto location = entities_[index];
+    if constexpr (is_sparse_v<T>) {
+      std::memcpy(sparse_set_of(type_index).insert(index, tick()), &value,
+                  sizeof(T));
+      return;
+    }
+
+    if (archetypes_[location.archetype].types.test(type_index)) {
+      auto &archetype = archetypes_[location.archetype];
+      const auto slot = archetype.at(location.idx);
+      std::memcpy(archetype.at(slot, type_index), &value, sizeof(T));
+      archetype.touch(slot, as_type_set<T>(), {}, tick());
+      return;
+    }
+
+    const auto target = archetype_with(location.archetype, type_index);
+    const auto slot = migrate(index, target);
+    std::memcpy(archetypes_[target].at(slot, type_index), &value, sizeof(T));
+  }
+
+  // Takes the component `T` away from `ent`, if it has one.
+  template <class T> void remove(const entity_t ent) {
+    assert(alive(ent));
+    const auto index = entity_info::from_entity_t(ent).index;
+    const auto type_index = registry.template index<T>();
+    const auto location = entities_[index];
+    if constexpr (is_sparse_v<T>) {
+      sparse_set_of(type_index).erase(index);
+      return;
+    }
+
+    if (!archetypes_[location.archetype].types.test(type_index)) {
+      return;
+    }
+    migrate(index, archetype_without(location.archetype, type_index));
+  }
+
+  // Inserts `count` entities made of `Ts...`, `generator(i)` giving the
+  // components of the ith one as a tuple. The archetype is looked up once and
+  // the components are written in place, chunk by chunk.
+  template <class... Ts, class Generator>
+  std::vector<entity_t> insert_batch(std::size_t count,
+                                     Generator &&generator) {
+    const auto types =
+        components_of(nostd::filter_t<is_table_term, nostd::typelist<Ts...>>{});
+    const std::size_t archetype_idx = find_or_insert_archetype_idx(types);
+    auto &archetype = archetypes_[archetype_idx];
+    const std::array<column_layout, sizeof...(Ts)> columns = {
+        archetype.layout.columns[registry.template index<Ts>()]...,
+    };
+
+    std::vector<entity_t> entities;
+    entities.reserve(count);
+    archetype.data.create_n(
+        count, [&](hive_entry_info_t first, hive_slot slot, std::size_t n) {
+          archetype.touch(slot, types, types, tick());
+          for (std::size_t i = 0; i < n; i++) {
+            const hive_slot row{slot.data,
+                                static_cast<std::uint32_t>(slot.index + i)};
+            const auto ent = new_entity();
+            const auto index = entity_info::from_entity_t(ent).index;
+            if constexpr ((is_sparse_v<Ts> || ...)) {
+              const std::tuple<Ts...> values = generator(entities.size());
+              std::apply(
+                  [&](const Ts &...value) {
+                    (std::memcpy(storage_of<Ts>(archetype, row, index), &value,
+                                 sizeof(Ts)),
+                     ...);
+                  },
+                  values);
+            } else {
+              entity_getter<Ts...>::from_slot(row, columns) =
+                  generator(entities.size());
+            }
+
+            archetype.set_entity(row, index);
+            place(ent, archetype_idx,
+                  hive_entry_info_t{
+                      .chunk = first.chunk,
+                      .chunk_index =
+                          static_cast<std::uint32_t>(first.chunk_index + i),
+                  }
+                      .to_hive_index());
+            entities.push_back(ent);
+          }
+        });
+    return entities;
+  }
+
+  // Packs the entities of the archetypes with holes in their chunks in as
+  // few chunks as they fit in, keeping their order, and gives the storage of
+  // the others back. Handles stay valid and the moved chunks are marked as
+  // changed. No query may be iterating meanwhile.
+  //
+  // Stops before the archetype that would bring the entities moved past
+  // `max_entities`, so that the work can be spread over several calls, each
+  // resuming where the last one stopped. Returns whether every archetype is
+  // packed.
+  bool defragment(std::size_t max_entities = static_cast<std::size_t>(-1)) {
+    ECS_PROFILE_SCOPE("world::defragment");
+    std::vector<hive_index_t> order;
+    std::size_t moved = 0;
+    for (std::size_t n = 0; n < archetypes_.size(); n++) {
+      if (defragment_cursor_ >= archetypes_.size()) {
+        defragment_cursor_ = 0;
+      }
+      auto &archetype = archetypes_[defragment_cursor_];
+      if (fragmented(archetype)) {
+        storage_order(archetype, order);
+        if (moved != 0 &&
+            (moved >= max_entities || order.size() > max_entities - moved)) {
+          return false;
+        }
+        repack(defragment_cursor_, order);
+        moved += order.size();
+      }
+      defragment_cursor_++;
+    }
+    return true;
+  }
+
+  // Reorders the entities of the archetypes with a `T` by increasing
+  // `key(const T &)`, entities of equal keys staying in storage order, and
+  // packs them as defragment() does. Archetypes already sorted and packed are
+  // left alone. No query may be iterating meanwhile.
+  template <class T, class Key> void sort_by(Key &&key) {
+    static_assert(!is_sparse_v<T>, "sparse set components have no rows");
+    ECS_PROFILE_SCOPE("world::sort_by");
+    using key_t = std::remove_cvref_t<std::invoke_result_t<Key &, const T &>>;
+    const auto type_index = registry.template index<T>();
+    std::vector<hive_index_t> order;
+    std::vector<std::pair<key_t, hive_index_t>> keyed;
+    const auto by_key = [](const auto &a, const auto &b) {
+      return a.first < b.first;
+    };
+    for (std::size_t a = 0; a < archetypes_.size(); a++) {
+      auto &archetype = archetypes_[a];
+      if (!archetype.types.test(type_index)) {
+        continue;
+      }
+      storage_order(archetype, order);
+      keyed.clear();
+      for (const auto idx : order) {
+        const auto &value = *reinterpret_cast<const T *>(
+            archetype.at(archetype.at(idx), type_index));
+        keyed.emplace_back(key(value), idx);
+      }
+      if (std::ranges::is_sorted(keyed, by_key) && !fragmented(archetype)) {
+        continue;
+      }
+      std::ranges::stable_sort(keyed, by_key);
+      for (std::size_t i = 0; i < keyed.size(); i++) {
+        order[i] = keyed[i].second;
+      }
+      repack(a, order);
+    }
+  }
+
+  // The command buffer of the calling thread, to record structural changes
+  // while queries are being iterated. They are applied by flush().
+  command_buffer<basic_world> &commands() {
+    thread_local std::vector<
+        std::pair<std::uint64_t, command_buffer<basic_world> *>>
+        cache;
+    for (const auto &[id, buffer] : cache) {
+      if (id == id_) {
+        return *buffer;
+      }
+    }
 
+    std::scoped_lock lock{commands_mutex_};
+    auto &buffer = command_buffers_.emplace_back(
+        std::make_unique<command_buffer<basic_world>>(this));
+    cache.emplace_back(id_, buffer.get());
+    return *buffer;
+  }
+
+  // Applies the recorded commands, no query may be iterating meanwhile.
+  //
+  // The commands are applied per entity rather than in recording order: all
+  // the changes made to an entity are folded so that it migrates at most
+  // once, straight to its final archetype, and entities are moved in batches
+  // sorted by destination archetype. Commands of the same thread apply in
+  // recording order, commands of different threads in no particular one.
+  void flush() {
+    using buffer_t = command_buffer<basic_world>;
+    using command_t = buffer_t::command;
+    struct recorded {
+      const buffer_t *buffer;
+      const command_t *cmd;
+    };
+
+    std::vector<recorded> changes;
+    std::vector<recorded> inserts;
+    for (const auto &buffer : command_buffers_) {
+      for (const auto &cmd : buffer->commands()) {
+        (cmd.op == buffer_t::kind::insert ? inserts : changes)
+            .push_back({buffer.get(), &cmd});
+      }
+    }
+
+    const auto index_of = [](const recorded &r) {
+      return entity_info::from_entity_t(r.cmd->ent).index;
+    };
+    std::ranges::stable_sort(changes, {}, index_of);
+
+    const auto sparse = sparse_types();
+    struct migration {
+      std::uint32_t index;
+      std::size_t target;
+      // Final components of the entity, sparse ones included.
+      type_set types;
+      // changes[first, last) are the commands of the entity.
+      std::size_t first;
+      std::size_t last;
+    };
+    std::vector<migration> migrations;
+    for (std::size_t first = 0, last = 0; first < changes.size();
+         first = last) {
+      const auto index = index_of(changes[first]);
+      last = first;
+      while (last < changes.size() && index_of(changes[last]) == index) {
+        last++;
+      }
+
+      // Handles of the same index can be stale, only the live one counts.
+      std::optional<entity_t> ent;
+      auto types = type_set{};
+      bool despawned = false;
+      for (auto i = first; i < last && !despawned; i++) {
+        const auto &cmd = *changes[i].cmd;
+        if (!alive(cmd.ent)) {
+          continue;
+        }
+        if (!ent) {
+          ent = cmd.ent;
+          types = archetypes_[entities_[index].archetype].types |
+                  sparse_membership(index, sparse);
+        }
+
+        switch (cmd.op) {
+        case buffer_t::kind::despawn:
+          despawned = true;
+          break;
+        case buffer_t::kind::add:
+          types |= cmd.types;
+          break;
+        case buffer_t::kind::remove:
+          types &= ~cmd.types;
+          break;
+        case buffer_t::kind::insert:
+          break;
+        }
+      }
+
+      if (!ent) {
+        continue;
+      }
+      if (despawned) {
+        despawn(*ent);
+        continue;
+      }
+      migrations.push_back({
+          .index = index,
+          .target = find_or_insert_archetype_idx(types & ~sparse),
+          .types = types,
+          .first = first,
+          .last = last,
+      });
+    }
+
+    std::ranges::stable_sort(migrations, {}, &migration::target);
+    for (const auto &m : migrations) {
+      if (entities_[m.index].archetype != m.target) {
+        migrate(m.index, m.target);
+      }
+
+      (sparse & ~m.types).for_each([&](std::size_t i) {
+        if (sparse_sets_[i]) {
+          sparse_sets_[i]->erase(m.index);
+        }
+      });
+
+      auto &archetype = archetypes_[m.target];
+      const auto slot = archetype.at(entities_[m.index].idx);
+      for (auto i = m.first; i < m.last; i++) {
+        const auto &[buffer, cmd] = changes[i];
+        if (cmd->op != buffer_t::kind::add || !alive(cmd->ent)) {
+          continue;
+        }
+        for (const auto &value : buffer->values(*cmd)) {
+          if (archetype.types.test(value.type_index)) {
+            std::memcpy(archetype.at(slot, value.type_index),
+                        buffer->bytes(value), registry.size(value.type_index));
+          } else if (m.types.test(value.type_index)) {
+            std::memcpy(
+                sparse_set_of(value.type_index).insert(m.index, tick()),
+                buffer->bytes(value), registry.size(value.type_index));
+          }
+        }
+        archetype.touch(slot, cmd->types & archetype.types, {}, tick());
+      }
+    }
+
+    std::vector<std::pair<std::size_t, recorded>> sorted_inserts;
+    sorted_inserts.reserve(inserts.size());
+    for (const auto &r : inserts) {
+      sorted_inserts.emplace_back(
+          find_or_insert_archetype_idx(r.cmd->types & ~sparse), r);
+    }
+    std::ranges::stable_sort(sorted_inserts, {},
+                             &std::pair<std::size_t, recorded>::first);
+    for (const auto &[archetype_idx, r] : sorted_inserts) {
+      auto &archetype = archetypes_[archetype_idx];
+      const auto ent = new_entity();
+      const auto index = entity_info::from_entity_t(ent).index;
+      const auto [idx, slot] =
+          archetype.create(index, tick(), r.cmd->types & ~sparse);
+      for (const auto &value : r.buffer->values(*r.cmd)) {
+        auto *storage =
+            sparse.test(value.type_index)
+                ? sparse_set_of(value.type_index).insert(index, tick())
+                : archetype.at(slot, value.type_index);
+        std::memcpy(storage, r.buffer->bytes(value),
+                    registry.size(value.type_index));
+      }
+      place(ent, archetype_idx, idx);
+    }
+
+    for (auto &buffer : command_buffers_) {
+      buffer->clear();
+    }
+  }
+
+  // Storage used by the archetypes created from now on.
+  storage_mode storage = storage_mode::columns;
+  // Alignment of the columns of the archetypes created from now on, on top of
+  // the alignment of their components. A cache line by default, so that
+  // columns never share one and SIMD loads can be aligned.
+  std::size_t column_alignment = 64;
+  // Whether the archetypes created from now on fill the holes left by
+  // despawned entities with their last entity, see Archetype::dense.
+  bool dense = true;
+  // Storage of the chunks of the archetypes created from now on, their
+  // capacity following from the size of their entities. Small enough by
+  // default for a chunk of every column a system touches to stay in L2.
+  std::size_t chunk_bytes = 16 * 1024;
+
+  /* private: */
+  chunk_allocator *allocator_;
+  std::atomic<std::uint64_t> tick_ = 1;
+  std::vector<archetype> archetypes_;
+
+  // Tells worlds apart in the thread local caches of commands().
+  std::uint64_t id_ = [] {
+    static std::atomic<std::uint64_t> next = 0;
+    return next++;
+  }();
+  std::vector<std::unique_ptr<command_buffer<basic_world>>> command_buffers_;
+  std::mutex commands_mutex_;
+
+  // Indexed by type index, null until the first use of a sparse component.
+  std::array<std::unique_ptr<sparse_set>, Registry::max_components>
+      sparse_sets_;
+
+  // Indexed by entity_info::index. Indices of despawned entities are reused
+  // from `free_entities_`, newest first.
+  std::vector<entity_location> entities_;
+  std::vector<std::uint32_t> free_entities_;
+  static constexpr std::uint32_t max_generation =
+      static_cast<std::uint32_t>(-1);
+
+  // Allocates an entity index, the entity must then be placed.
+  entity_t new_entity() {
+    if (!free_entities_.empty()) {
+      const auto index = free_entities_.back();
+      free_entities_.pop_back();
+      return entity_info{
+          .index = index,
+          .generation = entities_[index].generation,
+      }
+          .into_entity_t();
+    }
+
+    entities_.push_back({});
     return entity_info{
+        .index = static_cast<std::uint32_t>(entities_.size() - 1),
         .generation = 0,
-        .archetype = static_cast<uint16_t>(archetype_idx),
-        .idx = idx,
     }
         .into_entity_t();
   }
 
-  /* private: */
-  std::vector<archetype> archetypes_;
+  // Moves the entity of `index` to the archetype `target_idx`, copying the
+  // components both archetypes have. Returns the new slot of the entity, the
+  // components only `target_idx` has are left uninitialized.
+  hive_slot migrate(std::uint32_t index, std::size_t target_idx) {
+    auto &location = entities_[index];
+    auto &src = archetypes_[location.archetype];
+    auto &dst = archetypes_[target_idx];
+
+    const auto [idx, dst_slot] =
+        dst.create(index, tick(), dst.types & ~src.types);
+    const auto src_slot = src.at(location.idx);
+    const auto common = src.types & dst.types;
+    common.for_each([&](std::size_t i) {
+      std::memcpy(dst.at(dst_slot, i), src.at(src_slot, i),
+                  src.layout.columns[i].size);
+      dst.carry_added(dst_slot, src, src_slot, i);
+    });
+
+    if (const auto moved = src.remove(location.idx, tick())) {
+      entities_[*moved].idx = location.idx;
+    }
+    location.archetype = static_cast<std::uint32_t>(target_idx);
+    location.idx = idx;
+    return dst_slot;
+  }
+
+  // The sparse components among `sparse` the entity of `index` has.
+  type_set sparse_membership(std::uint32_t index, const type_set &sparse) {
+    type_set types;
+    sparse.for_each([&](std::size_t i) {
+      types.set(i, sparse_sets_[i] && sparse_sets_[i]->contains(index));
+    });
+    return types;
+  }
 
-  std::size_t find_or_insert_archetype_idx(type_set types, type_info tinfo) {
-    for (std::size_t i = 0; i < archetypes_.size(); i++) {
-      if (archetypes_[i].types == types) {
-        return i;
+  // Where the component `T` of the entity of `index`, at `slot` of
+  // `archetype`, is to be written. A sparse one is given to the entity.
+  template <class T>
+  std::byte *storage_of(archetype &archetype, hive_slot slot,
+                        std::uint32_t index) {
+    const auto type_index = registry.template index<std::remove_const_t<T>>();
+    if constexpr (is_sparse_v<T>) {
+      return sparse_set_of(type_index).insert(index, tick());
+    } else {
+      return archetype.at(slot, type_index);
+    }
+  }
+
+  // The component `T` the entity of `index` has, changed at the current tick
+  // if sparse and not const.
+  template <class T>
+  T &component_of(archetype &archetype, hive_slot slot, std::uint32_t index) {
+    const auto type_index = registry.template index<std::remove_const_t<T>>();
+    if constexpr (is_sparse_v<T>) {
+      auto &set = sparse_set_of(type_index);
+      assert(set.contains(index));
+      if constexpr (!std::is_const_v<T>) {
+        set.ticks(index).changed = tick();
       }
+      return *reinterpret_cast<T *>(set.find(index));
+    } else {
+      return *reinterpret_cast<T *>(archetype.at(slot, type_index));
     }
+  }
+
+  void place(entity_t ent, std::size_t archetype_idx, hive_index_t idx) {
+    auto &location = entities_[entity_info::from_entity_t(ent).index];
+    location.archetype = static_cast<std::uint32_t>(archetype_idx);
+    location.idx = idx;
+  }
+
+  // Archetype defragment() resumes from.
+  std::size_t defragment_cursor_ = 0;
 
-    archetypes_.emplace_back(types, tinfo);
+  // Whether some chunk of `archetype` but the last is not full, or the last
+  // has holes.
+  static bool fragmented(const archetype &archetype) {
+    const auto chunks = archetype.data.chunks();
+    for (std::size_t c = 0; c < chunks.size(); c++) {
+      const bool last = c + 1 == chunks.size();
+      if (last ? chunks[c].top != chunks[c].size
+               : chunks[c].size != chunks[c].capacity) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Sets `order` to the hive indices of the entities of `archetype`, in
+  // storage order.
+  static void storage_order(const archetype &archetype,
+                            std::vector<hive_index_t> &order) {
+    order.clear();
+    const auto chunks = archetype.data.chunks();
+    for (std::size_t c = 0; c < chunks.size(); c++) {
+      chunks[c].for_each_run([&](std::size_t begin, std::size_t end) {
+        for (auto i = begin; i < end; i++) {
+          order.push_back(hive_entry_info_t{
+              .chunk = static_cast<std::uint32_t>(c),
+              .chunk_index = static_cast<std::uint32_t>(i),
+          }
+                              .to_hive_index());
+        }
+      });
+    }
+  }
+
+  // Moves the entities of `archetype_idx` to new chunks, packed in the order
+  // of `order` which holds all of them. The new chunks are changed at the
+  // current tick and added at the latest tick of the chunks they come from.
+  void repack(std::size_t archetype_idx, std::span<const hive_index_t> order) {
+    auto &archetype = archetypes_[archetype_idx];
+    const auto &layout = archetype.layout;
+    hive packed{layout.chunk_size, layout.alignment, layout.capacity,
+                allocator_};
+    std::size_t next = 0;
+    packed.create_n(
+        order.size(),
+        [&](hive_entry_info_t first, hive_slot slot, std::size_t n) {
+          archetype.touch(slot, archetype.types, archetype.types, 0);
+          for (std::size_t i = 0; i < n; i++, next++) {
+            const auto src = archetype.at(order[next]);
+            const hive_slot dst{slot.data,
+                                static_cast<std::uint32_t>(slot.index + i)};
+            archetype.types.for_each([&](std::size_t t) {
+              std::memcpy(archetype.at(dst, t), archetype.at(src, t),
+                          layout.columns[t].size);
+              archetype.carry_added(dst, archetype, src, t);
+            });
+            const auto index = archetype.entity_at(src);
+            archetype.set_entity(dst, index);
+            entities_[index].idx =
+                hive_entry_info_t{
+                    .chunk = first.chunk,
+                    .chunk_index =
+                        static_cast<std::uint32_t>(first.chunk_index + i),
+                }
+                    .to_hive_index();
+          }
+          archetype.touch(slot, archetype.types, {}, tick());
+        });
+    archetype.data = std::move(packed);
+  }
+
+  // Indexed by next_query_id(), one per query type.
+  std::vector<std::unique_ptr<query_state_base>> queries_;
+  std::mutex queries_mutex_;
+
+  static std::size_t next_query_id() {
+    static std::atomic<std::size_t> next = 0;
+    return next++;
+  }
+
+  std::unordered_map<type_set, std::size_t> archetypes_by_types_;
+  // The types of each archetype, packed to be matched in bulk.
+  std::vector<type_set> archetype_types_;
+
+  std::size_t find_or_insert_archetype_idx(type_set types) {
+    assert((types & sparse_types()).none());
+    if (const auto it = archetypes_by_types_.find(types);
+        it != archetypes_by_types_.end()) {
+      return it->second;
+    }
+
+    return add_archetype(
+        types, layout_of(types, storage, column_alignment, chunk_bytes), dense);
+  }
+
+  std::size_t
+  add_archetype(type_set types,
+                const archetype_layout<Registry::max_components> &layout,
+                bool dense) {
+    archetypes_.emplace_back(types, layout, dense, allocator_);
+    archetype_types_.push_back(types);
+    archetypes_by_types_.emplace(types, archetypes_.size() - 1);
     return archetypes_.size() - 1;
   }
 
+  // Archetype of the entities of `archetype_idx` once given the component
+  // `type_index`.
+  std::size_t archetype_with(std::size_t archetype_idx,
+                             std::size_t type_index) {
+    auto &edges = archetypes_[archetype_idx].with_edges;
+    if (const auto it = edges.find(type_index); it != edges.end()) {
+      return it->second;
+    }
+
+    auto types = archetypes_[archetype_idx].types;
+    types.set(type_index);
+    const auto target = find_or_insert_archetype_idx(types);
+    // `archetypes_` may have grown, don't reuse `edges`.
+    archetypes_[archetype_idx].with_edges.emplace(type_index, target);
+    archetypes_[target].without_edges.emplace(type_index, archetype_idx);
+    return target;
+  }
+
+  // Archetype of the entities of `archetype_idx` once the component
+  // `type_index` is removed from them.
+  std::size_t archetype_without(std::size_t archetype_idx,
+                                std::size_t type_index) {
+    auto &edges = archetypes_[archetype_idx].without_edges;
+    if (const auto it = edges.find(type_index); it != edges.end()) {
+      return it->second;
+    }
+
+    auto types = archetypes_[archetype_idx].types;
+    types.reset(type_index);
+    const auto target = find_or_insert_archetype_idx(types);
+    archetypes_[archetype_idx].without_edges.emplace(type_index, target);
+    archetypes_[target].with_edges.emplace(type_index, archetype_idx);
+    return target;
+  }
+
+  // The components of the query terms `Ts`.
+  template <class... Ts>
+  constexpr type_set components_of(nostd::typelist<Ts...>) {
+    return as_type_set<term_component_t<Ts>...>();
+  }
+
   template <class... Ts> constexpr type_set as_type_set() {
-    std::array<size_t, sizeof...(Ts)> v{registry.template index<Ts>()...};
-    std::bitset<Registry::max_components> b;
-    for (const auto index : v) {
-      b |= 1 << index;
+    if constexpr (static_registry<Registry>) {
+      // Folded at compile time.
+      constexpr auto b = type_set::of({Registry::template index<Ts>()...});
+      return b;
+    } else {
+      return type_set::of({registry.template index<Ts>()...});
     }
-    return b;
   }
 
-  template <class T> constexpr std::size_t offset_in(type_set types) {
-    std::size_t offset = 0;
-    const auto t_index = registry.template index<T>();
-    for (std::size_t i = 0; i < t_index; i++) {
-      if (types.test(i)) {
-        offset += registry.size(i);
+  // Chunks start with the change ticks of the components, which are then
+  // placed by decreasing alignment so that packed rows need as little padding
+  // as possible. Chunks hold as many entities as fit in `chunk_bytes`, one at
+  // least.
+  archetype_layout<Registry::max_components>
+  layout_of(type_set types, storage_mode mode, std::size_t column_alignment,
+            std::size_t chunk_bytes) {
+    archetype_layout<Registry::max_components> layout{
+        .mode = mode,
+        .chunk_size = 0,
+        .alignment = column_alignment,
+        .capacity = 0,
+        .columns = {},
+        .entities = {},
+        .column_alignment = column_alignment,
+        .chunk_bytes = chunk_bytes,
+    };
+
+    struct pending {
+      std::size_t size;
+      std::size_t alignment;
+      column_layout *column;
+    };
+    std::vector<pending> columns{
+        {sizeof(std::uint32_t), alignof(std::uint32_t), &layout.entities},
+    };
+    types.for_each([&](std::size_t i) {
+      columns.push_back(
+          {registry.size(i), registry.alignment(i), &layout.columns[i]});
+    });
+    std::ranges::stable_sort(columns, std::ranges::greater{},
+                             &pending::alignment);
+    for (const auto &c : columns) {
+      layout.alignment = std::max(layout.alignment, c.alignment);
+    }
+
+    const auto ticks_size = (columns.size() - 1) * sizeof(change_ticks);
+    switch (mode) {
+    case storage_mode::rows: {
+      const auto base = nostd::align_up(ticks_size, columns.front().alignment);
+      std::size_t offset = 0;
+      for (const auto &c : columns) {
+        offset = nostd::align_up(offset, c.alignment);
+        *c.column = {
+            .offset = base + offset, .stride = 0, .size = c.size, .ticks = 0};
+        offset += c.size;
+      }
+      const auto stride = nostd::align_up(offset, columns.front().alignment);
+      for (const auto &c : columns) {
+        c.column->stride = stride;
+      }
+      layout.capacity = std::max<std::size_t>(
+          chunk_bytes > base ? (chunk_bytes - base) / stride : 0, 1);
+      layout.chunk_size = base + stride * layout.capacity;
+      break;
+    }
+    case storage_mode::columns: {
+      const auto place = [&](std::size_t capacity) {
+        std::size_t offset = ticks_size;
+        for (const auto &c : columns) {
+          offset =
+              nostd::align_up(offset, std::max(c.alignment, column_alignment));
+          *c.column = {
+              .offset = offset, .stride = c.size, .size = c.size, .ticks = 0};
+          offset += c.size * capacity;
+        }
+        return offset;
+      };
+
+      std::size_t row = 0;
+      for (const auto &c : columns) {
+        row += c.size;
       }
+      // Columns are padded to their alignment: start from the capacity
+      // without padding and shrink until it fits.
+      auto capacity = std::max<std::size_t>(
+          chunk_bytes > ticks_size ? (chunk_bytes - ticks_size) / row : 0, 1);
+      while (capacity > 1 && place(capacity) > chunk_bytes) {
+        capacity--;
+      }
+      layout.capacity = capacity;
+      layout.chunk_size = place(capacity);
+      break;
+    }
     }
-    return offset;
+
+    std::size_t ticks = 0;
+    types.for_each([&](std::size_t i) {
+      layout.columns[i].ticks = ticks;
+      ticks += sizeof(change_ticks);
+    });
+    return layout;
   }
 };
 
@@ -310,5 +2090,6 @@ struct static_registry_from_list<nostd::typelist<Tn...>> {
 };
 template <class T>
 using static_registry_from_list_t = static_registry_from_list<T>::type;
-using DynamicWorld = ecs::basic_world<ecs::DynamicRegistry<8>>;
+// A type set still fits a word.
+using DynamicWorld = ecs::basic_world<ecs::DynamicRegistry<64>>;
 } // namespace ecs
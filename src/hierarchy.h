@@ -0,0 +1,306 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "ecs.h"
+#include "thread_pool.h"
+
+namespace ecs {
+
+// Makes its entity a child of `parent`. A registry component like any other.
+struct ChildOf {
+  entity_t parent;
+};
+
+// The trees made by the ChildOf components of a world, flattened in breadth
+// first order: the nodes of depth d are nodes()[levels()[d], levels()[d + 1])
+// and the children of a node are next to each other, in the order of their
+// parents. Values are propagated from the roots by one pass over contiguous
+// arrays per depth, and components are read and written in storage order,
+// never through entity handles.
+//
+// Roots are the parents that have no ChildOf, or a despawned parent. Entities
+// in a cycle are left out.
+template <class World> class hierarchy {
+public:
+  static constexpr std::uint32_t npos = static_cast<std::uint32_t>(-1);
+
+  struct node {
+    // Index of the entity, see entity_info.
+    std::uint32_t entity;
+    // Position of the parent in nodes(), npos for the roots.
+    std::uint32_t parent;
+  };
+
+  std::span<const node> nodes() const { return nodes_; }
+  std::span<const std::size_t> levels() const { return levels_; }
+  std::size_t depth() const { return levels_.size() - 1; }
+  // Position in nodes() of the entity of `index`, npos if none.
+  std::uint32_t position(std::uint32_t index) const {
+    return index < positions_.size() ? positions_[index] : npos;
+  }
+
+  // Rebuilds the trees if a ChildOf was given, changed or taken, or a root
+  // despawned, since the last update. No query may be iterating meanwhile.
+  void update(World &world) {
+    // Changes made from now on have a later tick.
+    const auto now = world.tick_.fetch_add(1, std::memory_order_relaxed);
+    std::size_t children = 0;
+    bool changed = false;
+    for_each_chunk<ChildOf>(world, [&](auto &archetype, chunk &c) {
+      const auto &ticks = archetype.ticks(c.slot(0), child_of_index(world));
+      changed |= ticks.changed > since_ || ticks.added > since_;
+      children += c.size;
+    });
+    changed |= children != children_;
+    for (const auto root : roots_) {
+      changed |= !world.alive(root);
+    }
+    since_ = now;
+    if (changed) {
+      rebuild(world, children);
+    }
+  }
+
+  // Computes the `Global` of every child as `compose(parent, local)`, from
+  // the `Global` of its parent and its own `Local`, a level after the other
+  // with each level split in jobs of `grain` nodes run on `pool`. The
+  // `Global` of the roots is left as is. Missing components are value
+  // initialized, and children without `Global` still pass it down. The
+  // buffers are kept from one call to the next: once they fit the trees,
+  // propagating allocates nothing.
+  template <class Local, class Global, class Compose>
+  void propagate(World &world, Compose &&compose, std::size_t grain = 4096,
+                 thread_pool &pool = thread_pool::global()) {
+    static_assert(!std::is_same_v<Local, Global>,
+                  "the local value of a child would be overwritten");
+    ECS_PROFILE_SCOPE("hierarchy::propagate");
+    if (nodes_.empty()) {
+      return;
+    }
+
+    const auto locals = scratch<Local>(locals_, nodes_.size());
+    const auto globals = scratch<Global>(globals_, nodes_.size());
+    const auto roots = static_cast<std::uint32_t>(levels_[1]);
+    gather<Global>(world, pool, [&](std::uint32_t pos, const Global &value) {
+      if (pos < roots) {
+        globals[pos] = value;
+      }
+    });
+    gather<Local>(world, pool, [&](std::uint32_t pos, const Local &value) {
+      if (pos >= roots) {
+        locals[pos] = value;
+      }
+    });
+
+    for (std::size_t d = 1; d + 1 < levels_.size(); d++) {
+      const auto begin = levels_[d];
+      const auto size = levels_[d + 1] - begin;
+      pool.parallel_for((size + grain - 1) / grain, [&](std::size_t job) {
+        const auto first = begin + job * grain;
+        const auto last = std::min(first + grain, begin + size);
+        for (auto i = first; i < last; i++) {
+          globals[i] = compose(std::as_const(globals[nodes_[i].parent]),
+                               std::as_const(locals[i]));
+        }
+      });
+    }
+
+    scatter<Global>(world, pool, [&](std::uint32_t pos, Global &value) {
+      if (pos >= roots) {
+        value = globals[pos];
+        return true;
+      }
+      return false;
+    });
+  }
+
+private:
+  std::vector<node> nodes_;
+  std::vector<std::size_t> levels_ = {0};
+  // Indexed by entity index.
+  std::vector<std::uint32_t> positions_;
+  std::vector<entity_t> roots_;
+  std::size_t children_ = 0;
+  std::uint64_t since_ = 0;
+
+  struct chunk_job {
+    typename World::archetype *archetype;
+    chunk *c;
+  };
+  // Reused by every propagate(), see scratch.
+  std::vector<std::byte> locals_;
+  std::vector<std::byte> globals_;
+  std::vector<chunk_job> jobs_;
+
+  // `count` value initialized `T` in `storage`, which only grows.
+  template <class T>
+  static std::span<T> scratch(std::vector<std::byte> &storage,
+                              std::size_t count) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    const auto size = count * sizeof(T);
+    if (storage.size() < size + alignof(T)) {
+      storage.resize(size + alignof(T));
+    }
+    void *p = storage.data();
+    auto space = storage.size();
+    auto *out = static_cast<T *>(std::align(alignof(T), size, p, space));
+    std::uninitialized_value_construct_n(out, count);
+    return {out, count};
+  }
+
+  static std::size_t child_of_index(World &world) {
+    return world.registry.template index<ChildOf>();
+  }
+
+  // Calls `fn(archetype, chunk)` for the chunks with entities of the
+  // archetypes with a `T`.
+  template <class T, class Fn>
+  static void for_each_chunk(World &world, Fn &&fn) {
+    const auto type_index = world.registry.template index<T>();
+    for (auto &archetype : world.archetypes_) {
+      if (!archetype.types.test(type_index)) {
+        continue;
+      }
+      for (auto &c : archetype.data.chunks()) {
+        if (c.size != 0) {
+          fn(archetype, c);
+        }
+      }
+    }
+  }
+
+  // Calls `fn(position, value)` for the `T` of the nodes, chunks in
+  // parallel.
+  template <class T, class Fn>
+  void gather(World &world, thread_pool &pool, Fn &&fn) {
+    visit<T>(world, pool,
+             [&](auto &, chunk &, hive_slot, T &value, std::uint32_t pos) {
+               fn(pos, std::as_const(value));
+             });
+  }
+
+  // Calls `fn(position, value)` for the `T` of the nodes, marking the chunk
+  // as changed if it returns true, chunks in parallel.
+  template <class T, class Fn>
+  void scatter(World &world, thread_pool &pool, Fn &&fn) {
+    const auto type_index = world.registry.template index<T>();
+    const auto now = world.tick();
+    visit<T>(world, pool, [&](auto &archetype, chunk &, hive_slot slot,
+                              T &value, std::uint32_t pos) {
+      if (fn(pos, value)) {
+        archetype.ticks(slot, type_index).changed = now;
+      }
+    });
+  }
+
+  template <class T, class Fn>
+  void visit(World &world, thread_pool &pool, Fn &&fn) {
+    jobs_.clear();
+    for_each_chunk<T>(world, [&](auto &archetype, chunk &c) {
+      jobs_.push_back({&archetype, &c});
+    });
+
+    const auto type_index = world.registry.template index<T>();
+    pool.parallel_for(jobs_.size(), [&](std::size_t j) {
+      auto &[archetype, c] = jobs_[j];
+      c->for_each_run([&](std::size_t begin, std::size_t end) {
+        for (auto i = begin; i < end; i++) {
+          const auto slot = c->slot(static_cast<std::uint32_t>(i));
+          const auto pos = position(archetype->entity_at(slot));
+          if (pos != npos) {
+            fn(*archetype, *c, slot,
+               *reinterpret_cast<T *>(archetype->at(slot, type_index)), pos);
+          }
+        }
+      });
+    });
+  }
+
+  void rebuild(World &world, std::size_t children) {
+    ECS_PROFILE_SCOPE("hierarchy::rebuild");
+    struct edge {
+      std::uint32_t parent;
+      std::uint32_t child;
+    };
+    std::vector<edge> edges;
+    edges.reserve(children);
+    const auto entities = world.entities_.size();
+    // The children of the entity of index i are
+    // children[first[i], first[i + 1]), in storage order.
+    std::vector<std::uint32_t> first(entities + 1);
+    std::vector<bool> has_parent(entities);
+    const auto type_index = child_of_index(world);
+    for_each_chunk<ChildOf>(world, [&](auto &archetype, chunk &c) {
+      c.for_each_run([&](std::size_t begin, std::size_t end) {
+        for (auto i = begin; i < end; i++) {
+          const auto slot = c.slot(static_cast<std::uint32_t>(i));
+          const auto parent =
+              reinterpret_cast<const ChildOf *>(archetype.at(slot, type_index))
+                  ->parent;
+          if (!world.alive(parent)) {
+            continue;
+          }
+          const auto child = archetype.entity_at(slot);
+          const auto index = entity_info::from_entity_t(parent).index;
+          edges.push_back({index, child});
+          first[index + 1]++;
+          has_parent[child] = true;
+        }
+      });
+    });
+    for (std::size_t i = 0; i < entities; i++) {
+      first[i + 1] += first[i];
+    }
+    std::vector<std::uint32_t> children_of(edges.size());
+    {
+      auto cursor = first;
+      for (const auto &e : edges) {
+        children_of[cursor[e.parent]++] = e.child;
+      }
+    }
+
+    nodes_.clear();
+    levels_.assign({0});
+    roots_.clear();
+    positions_.assign(entities, npos);
+    for (std::uint32_t i = 0; i < entities; i++) {
+      if (first[i + 1] != first[i] && !has_parent[i]) {
+        positions_[i] = static_cast<std::uint32_t>(nodes_.size());
+        nodes_.push_back({i, npos});
+        roots_.push_back(entity_info{
+            .index = i,
+            .generation = world.entities_[i].generation,
+        }
+                             .into_entity_t());
+      }
+    }
+
+    while (levels_.back() != nodes_.size()) {
+      const auto begin = levels_.back();
+      const auto end = nodes_.size();
+      levels_.push_back(end);
+      for (auto p = begin; p < end; p++) {
+        const auto parent = nodes_[p].entity;
+        for (auto c = first[parent]; c < first[parent + 1]; c++) {
+          const auto child = children_of[c];
+          // Reached twice only through a cycle.
+          if (positions_[child] == npos) {
+            positions_[child] = static_cast<std::uint32_t>(nodes_.size());
+            nodes_.push_back({child, static_cast<std::uint32_t>(p)});
+          }
+        }
+      }
+    }
+    children_ = children;
+  }
+};
+
+} // namespace ecs
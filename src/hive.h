@@ -1,76 +1,150 @@
 #pragma once
 
-#include "nostd.h"
+#include <algorithm>
 #include <bit>
 #include <cassert>
 #include <cstddef>
 #include <cstdint>
 #include <memory>
-#include <optional>
+#include <span>
+#include <utility>
 #include <vector>
 
-enum class hive_index_t : std::uint32_t {};
+#include "chunk_allocator.h"
+
+enum class hive_index_t : std::uint64_t {};
 
 struct hive_entry_info_t {
-  std::uint16_t chunk;
-  std::uint16_t chunk_index;
+  std::uint32_t chunk;
+  std::uint32_t chunk_index;
 
-  hive_index_t to_hive_index() { return std::bit_cast<hive_index_t>(*this); }
+  hive_index_t to_hive_index() const {
+    return std::bit_cast<hive_index_t>(*this);
+  }
   static hive_entry_info_t from_hive_index(hive_index_t idx) {
     return std::bit_cast<hive_entry_info_t>(idx);
   }
 };
 
+// A slot handed out by a hive: the storage of the chunk it lives in and its
+// index in that chunk. How a slot is laid out inside the chunk storage is up
+// to the user of the hive (packed rows, one column per component, ...).
+struct hive_slot {
+  std::byte *data;
+  std::uint32_t index;
+};
+
+struct chunk_delete {
+  chunk_allocator *allocator;
+  std::size_t bytes;
+  std::size_t alignment;
+  void operator()(std::byte *p) const {
+    allocator->deallocate(p, bytes, alignment);
+  }
+};
+
+// A chunk of `capacity` slots. Live slots are tracked in an occupancy bitmap:
+// iterating skips a whole word of holes at once, and holes are reused before
+// the chunk grows.
 struct chunk {
-  union Data {
-    std::byte data[];
-    std::optional<uint16_t> next_free;
-  };
+  static constexpr std::size_t npos = static_cast<std::size_t>(-1);
 
-  std::size_t stride;
+  // Number of live slots.
   std::size_t size = 0;
+  // One past the last live slot.
+  std::size_t top = 0;
   std::size_t capacity = 0;
-  std::unique_ptr<std::byte[]> data;
-
-  // TODO: fixed chunk allocation
-  chunk(std::size_t stride)
-      : stride(std::max(stride, sizeof(Data))), capacity(1024),
-        data(new std::byte[stride * capacity]) {}
+  std::unique_ptr<std::byte[], chunk_delete> data;
+  std::unique_ptr<std::uint64_t[]> occupied;
+  // Position in the hive list of chunks with free slots, or in that of the
+  // chunks without storage; npos if full.
+  std::size_t room_index = npos;
+
+  // Without storage until allocate().
+  chunk(chunk_allocator *allocator, std::size_t bytes, std::size_t alignment,
+        std::size_t capacity)
+      : capacity(capacity),
+        data(nullptr, chunk_delete{allocator, bytes, alignment}) {}
+
+  bool allocated() const { return data != nullptr; }
+  void allocate() {
+    const auto &d = data.get_deleter();
+    data.reset(d.allocator->allocate(d.bytes, d.alignment));
+    occupied.reset(new std::uint64_t[words()]());
+  }
+  // Gives the storage back, the chunk must be empty.
+  void release() {
+    assert(size == 0);
+    data.reset();
+    occupied.reset();
+    top = 0;
+  }
 
-  auto get(uint16_t index) -> std::byte * {
-    return data.get() + index * stride;
+  std::size_t words() const { return (capacity + 63) / 64; }
+  bool live(std::size_t index) const {
+    return (occupied[index / 64] >> (index % 64)) & 1;
   }
-  auto create(uint16_t index)
-      -> std::pair<std::optional<uint16_t>, std::byte *> {
-    auto *d = get(index);
 
-    auto next_index = INLINE_LAMBDA->std::optional<uint16_t> {
-      if (index < size) { // if mem was init
-        return *reinterpret_cast<std::optional<uint16_t> *>(d);
+  // First slot in [from, end) that is live (resp. free), `end` if none.
+  std::size_t find(std::size_t from, std::size_t end, bool live) const {
+    while (from < end) {
+      auto word = occupied[from / 64];
+      if (!live) {
+        word = ~word;
       }
-
-      size++;
-      if (size == capacity) {
-        return std::nullopt;
+      word >>= from % 64;
+      if (word != 0) {
+        return std::min(from + std::countr_zero(word), end);
       }
+      from = (from / 64 + 1) * 64;
+    }
+    return end;
+  }
+  std::size_t next_live(std::size_t from) const {
+    return find(from, top, true);
+  }
+  std::size_t next_free(std::size_t from) const {
+    return find(from, capacity, false);
+  }
 
-      assert(size <= capacity);
-      return static_cast<uint16_t>(size);
-    };
-
-    return {
-        next_index,
-        d,
-    };
+  // Calls `fn(begin, end)` for each run [begin, end) of live slots.
+  template <class Fn> void for_each_run(Fn &&fn) const {
+    for (auto begin = next_live(0); begin < top;) {
+      const auto end = find(begin, top, false);
+      fn(begin, end);
+      begin = next_live(end);
+    }
   }
 
-  void remove(uint16_t index, std::optional<uint16_t> next_free) {
-    auto d = reinterpret_cast<std::optional<std::uint16_t> *>(get(index));
-    *d = next_free;
+  auto slot(uint32_t index) -> hive_slot { return {data.get(), index}; }
+
+  // Marks [begin, end) live, these slots must be free.
+  void fill(std::size_t begin, std::size_t end) {
+    for (auto i = begin; i < end; i++) {
+      assert(!live(i));
+      occupied[i / 64] |= std::uint64_t{1} << (i % 64);
+    }
+    size += end - begin;
+    top = std::max(top, end);
   }
 
-  std::byte *begin() { return data.get(); }
-  std::byte *end() { return data.get() + size * stride; }
+  void erase(std::size_t index) {
+    assert(live(index));
+    occupied[index / 64] &= ~(std::uint64_t{1} << (index % 64));
+    size--;
+    if (index + 1 != top) {
+      return;
+    }
+
+    // Lower `top` to the new last live slot.
+    for (auto w = (index + 1 + 63) / 64; w-- > 0;) {
+      if (occupied[w] != 0) {
+        top = w * 64 + 64 - std::countl_zero(occupied[w]);
+        return;
+      }
+    }
+    top = 0;
+  }
 };
 
 class hive;
@@ -79,14 +153,13 @@ class hive_iterator {
 
   chunk_iter chunk_cur{};
   chunk_iter chunk_end{};
-  std::byte *item_cur = nullptr;
-  std::byte *item_end = nullptr;
+  std::uint32_t item_cur = 0;
 
 public:
-  std::byte *operator*() { return item_cur; }
+  hive_slot operator*() { return chunk_cur->slot(item_cur); }
   inline hive_iterator &operator++() {
-    item_cur += chunk_cur->stride;
-    if (item_cur != item_end) {
+    item_cur = static_cast<std::uint32_t>(chunk_cur->next_live(item_cur + 1));
+    if (item_cur != chunk_cur->top) {
       return *this;
     }
 
@@ -101,12 +174,14 @@ public:
   /*   return out; */
   /* } */
   void next_chunk() {
+    while (chunk_cur != chunk_end && chunk_cur->size == 0) {
+      chunk_cur++;
+    }
     if (chunk_cur == chunk_end) {
       *this = end();
       return;
     }
-    item_cur = chunk_cur->begin();
-    item_end = chunk_cur->end();
+    item_cur = static_cast<std::uint32_t>(chunk_cur->next_live(0));
   }
 
   hive_iterator begin() { return *this; }
@@ -114,8 +189,7 @@ public:
     hive_iterator it{};
     it.chunk_cur = chunk_end;
     it.chunk_end = chunk_end;
-    it.item_cur = nullptr;
-    it.item_end = nullptr;
+    it.item_cur = 0;
     return it;
   }
 
@@ -128,69 +202,226 @@ public:
   hive_iterator(hive *h);
 };
 
+// Slots are allocated in chunks that are never moved, so a slot keeps its
+// hive_index_t until it is removed. Removed slots are reused inside their
+// chunk, chunks that become empty give their storage back.
 class hive {
 private:
   std::vector<chunk> inner;
-  std::optional<hive_entry_info_t> next_free;
+  // Chunks with storage and free slots, new slots go in the last one.
+  std::vector<std::uint32_t> with_room;
+  // Chunks that gave their storage back, only reused once the others are
+  // full.
+  std::vector<std::uint32_t> released;
   struct {
-    std::size_t size;
+    std::size_t bytes;
+    std::size_t alignment;
+    std::size_t capacity;
   } tinfo;
+  chunk_allocator *allocator;
+
+  // The list a chunk with room belongs in, following whether it has
+  // storage: chunks must leave it before they get or give back storage.
+  std::vector<std::uint32_t> &room_of(std::size_t chunk_index) {
+    return inner[chunk_index].allocated() ? with_room : released;
+  }
+
+  void add_room(std::size_t chunk_index) {
+    assert(inner[chunk_index].room_index == chunk::npos);
+    auto &list = room_of(chunk_index);
+    inner[chunk_index].room_index = list.size();
+    list.push_back(static_cast<std::uint32_t>(chunk_index));
+  }
+
+  void remove_room(std::size_t chunk_index) {
+    auto &list = room_of(chunk_index);
+    const auto pos = inner[chunk_index].room_index;
+    assert(pos != chunk::npos && list[pos] == chunk_index);
+    const auto moved = list.back();
+    list[pos] = moved;
+    inner[moved].room_index = pos;
+    list.pop_back();
+    inner[chunk_index].room_index = chunk::npos;
+  }
+
+  // A chunk to create slots in: one with storage if any, else a released
+  // one given storage again, else a new one.
+  std::uint32_t chunk_with_room() {
+    if (!with_room.empty()) {
+      return with_room.back();
+    }
+
+    std::size_t chunk_index;
+    if (!released.empty()) {
+      chunk_index = released.back();
+      remove_room(chunk_index);
+    } else {
+      assert(inner.size() < (std::size_t{1} << 32));
+      chunk_index = inner.size();
+      inner.emplace_back(allocator, tinfo.bytes, tinfo.alignment,
+                         tinfo.capacity);
+    }
+    inner[chunk_index].allocate();
+    add_room(chunk_index);
+    return static_cast<std::uint32_t>(chunk_index);
+  }
 
 public:
-  hive(std::size_t size) : tinfo{size} {}
+  static constexpr std::size_t default_chunk_capacity = 1024;
 
-  auto get(hive_index_t idx) -> std::span<std::byte> {
+  // Chunks hold `capacity` slots in `bytes` bytes of storage aligned on
+  // `alignment`, taken from `allocator`.
+  hive(std::size_t bytes, std::size_t alignment,
+       std::size_t capacity = default_chunk_capacity,
+       chunk_allocator *allocator = &heap_chunk_allocator::instance())
+      : tinfo{bytes, alignment, capacity}, allocator(allocator) {}
+
+  std::size_t chunk_capacity() const { return tinfo.capacity; }
+
+  auto get(hive_index_t idx) -> hive_slot {
     const auto info = hive_entry_info_t::from_hive_index(idx);
-    assert(info.chunk <= inner.size());
-    return {inner[info.chunk].get(info.chunk_index), tinfo.size};
+    assert(info.chunk < inner.size());
+    assert(inner[info.chunk].live(info.chunk_index));
+    return inner[info.chunk].slot(info.chunk_index);
   }
 
-  auto create() -> std::pair<hive_index_t, std::byte *> {
+  auto create() -> std::pair<hive_index_t, hive_slot> {
+    const auto chunk_index = chunk_with_room();
+    auto &c = inner[chunk_index];
+    const auto index = static_cast<std::uint32_t>(c.next_free(0));
+    c.fill(index, index + 1);
+    if (c.size == c.capacity) {
+      remove_room(chunk_index);
+    }
 
-    hive_entry_info_t info = INLINE_LAMBDA->hive_entry_info_t {
-      if (next_free) {
-        return *next_free;
-      } else {
-        inner.emplace_back(tinfo.size);
-        return {
-            .chunk = static_cast<std::uint16_t>(inner.size() - 1),
-            .chunk_index = 0,
-        };
-      }
+    return {
+        hive_entry_info_t{.chunk = chunk_index, .chunk_index = index}
+            .to_hive_index(),
+        c.slot(index),
     };
+  }
 
-    auto [new_next_free, data] = inner[info.chunk].create(info.chunk_index);
-    next_free = INLINE_LAMBDA->std::optional<hive_entry_info_t> {
-      if (new_next_free) {
-        return hive_entry_info_t{
-            .chunk = info.chunk,
-            .chunk_index = *new_next_free,
-        };
+  // Creates `count` slots. Calls `fn(first, slot, n)` for each run of `n`
+  // consecutive slots of a chunk, `first` and `slot` being the first of them.
+  template <class Fn> void create_n(std::size_t count, Fn &&fn) {
+    while (count > 0) {
+      const auto chunk_index = chunk_with_room();
+      auto &c = inner[chunk_index];
+      const auto begin = c.next_free(0);
+      const auto end = std::min(begin + count, c.find(begin, c.capacity, true));
+      c.fill(begin, end);
+      if (c.size == c.capacity) {
+        remove_room(chunk_index);
       }
+      count -= end - begin;
 
-      return std::nullopt;
-    };
+      const auto first = static_cast<std::uint32_t>(begin);
+      fn(hive_entry_info_t{.chunk = chunk_index, .chunk_index = first},
+         c.slot(first), end - begin);
+    }
+  }
 
-    return {info.to_hive_index(), data};
+  // The last slot of the last chunk. The hive must not be empty.
+  hive_index_t back() const {
+    assert(!inner.empty());
+    return hive_entry_info_t{
+        .chunk = static_cast<std::uint32_t>(inner.size() - 1),
+        .chunk_index = static_cast<std::uint32_t>(inner.back().top - 1),
+    }
+        .to_hive_index();
   }
 
+  void pop_back() { remove(back()); }
+
   void remove(hive_index_t idx) {
     const auto info = hive_entry_info_t::from_hive_index(idx);
-    std::optional<uint16_t> next_free_chunk_index;
-    if (next_free) {
-      next_free_chunk_index = next_free->chunk_index;
+    auto &c = inner[info.chunk];
+    c.erase(info.chunk_index);
+    if (c.room_index == chunk::npos) {
+      add_room(info.chunk);
+    }
+    if (c.size != 0) {
+      return;
+    }
+
+    remove_room(info.chunk);
+    c.release();
+    add_room(info.chunk);
+    // Trailing empty chunks are dropped altogether so that back() is live.
+    while (!inner.empty() && !inner.back().allocated()) {
+      remove_room(inner.size() - 1);
+      inner.pop_back();
+    }
+  }
+
+  std::span<chunk> chunks() { return inner; }
+  std::span<const chunk> chunks() const { return inner; }
+
+  // Gives the chunk `chunk_index` the live slots set in `occupied`, to mirror
+  // the chunks() of another hive; one past the last chunk appends one. A chunk
+  // without storage gets `adopted`, given back to `owner` once released, or
+  // storage from the hive allocator if null. An empty `occupied` releases the
+  // storage of the chunk.
+  chunk &restore_chunk(std::size_t chunk_index,
+                       std::span<const std::uint64_t> occupied,
+                       std::byte *adopted = nullptr,
+                       chunk_allocator *owner = nullptr) {
+    assert(chunk_index <= inner.size());
+    if (chunk_index == inner.size()) {
+      assert(inner.size() < (std::size_t{1} << 32));
+      inner.emplace_back(allocator, tinfo.bytes, tinfo.alignment,
+                         tinfo.capacity);
+    }
+
+    auto &c = inner[chunk_index];
+    if (c.room_index != chunk::npos) {
+      remove_room(chunk_index);
+    }
+    c.size = 0;
+    c.top = 0;
+    if (occupied.empty()) {
+      if (c.allocated()) {
+        c.release();
+      }
+    } else {
+      assert(occupied.size() == c.words());
+      if (!c.allocated() && adopted != nullptr) {
+        c.data = {adopted, chunk_delete{owner, tinfo.bytes, tinfo.alignment}};
+        c.occupied.reset(new std::uint64_t[c.words()]());
+      } else if (!c.allocated()) {
+        c.allocate();
+      }
+      std::ranges::copy(occupied, c.occupied.get());
+      for (std::size_t w = 0; w < occupied.size(); w++) {
+        c.size += std::popcount(occupied[w]);
+        if (occupied[w] != 0) {
+          c.top = w * 64 + 64 - std::countl_zero(occupied[w]);
+        }
+      }
+    }
+
+    if (c.size != c.capacity) {
+      add_room(chunk_index);
+    }
+    return c;
+  }
+
+  // Drops the chunks past the first `count`, see restore_chunk().
+  void truncate(std::size_t count) {
+    while (inner.size() > count) {
+      if (inner.back().room_index != chunk::npos) {
+        remove_room(inner.size() - 1);
+      }
+      inner.pop_back();
     }
-    inner[info.chunk_index].remove(info.chunk_index, next_free_chunk_index);
-    next_free = info;
   }
 
-  hive_iterator begin() { return hive_iterator{this}.end(); }
-  hive_iterator end() { return hive_iterator{this}; }
+  hive_iterator begin() { return hive_iterator{this}; }
+  hive_iterator end() { return hive_iterator{this}.end(); }
   friend hive_iterator;
 };
 
 inline hive_iterator::hive_iterator(hive *h)
-    : chunk_cur(h->inner.begin()), chunk_end(h->inner.end()), item_cur(nullptr),
-      item_end(nullptr) {
+    : chunk_cur(h->inner.begin()), chunk_end(h->inner.end()) {
   next_chunk();
 }
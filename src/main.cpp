@@ -1,6 +1,6 @@
 
-#define TIMED_INLINE_LAMBDA_DISABLE
 #include "ecs.h"
+#include "scheduler.h"
 
 #include "nostd.h"
 #include <SDL_events.h>
@@ -11,12 +11,17 @@
 #include <cmath>
 #include <cstddef>
 #include <cstdlib>
+#include <fstream>
 #include <iostream>
 
 #include <SDL2/SDL.h>
+#include <array>
+#include <atomic>
 #include <numbers>
 #include <optional>
 #include <random>
+#include <span>
+#include <tuple>
 #include <utility>
 #include <vector>
 
@@ -32,9 +37,21 @@ using list = nostd::typelist<pos, speed, particule_info>;
 } // namespace components
 
 class Renderer {
+  // Points extracted from the world, kept from frame to frame.
+  struct staging_buffer {
+    std::vector<SDL_FPoint> points;
+    std::size_t count;
+  };
+
   struct M {
     SDL_Window *win;
     SDL_Renderer *ren;
+    int width;
+    int height;
+
+    // extract() fills staging[back] while submit() draws the other one.
+    std::array<staging_buffer, 2> staging;
+    std::size_t back;
   } m;
   Renderer(M &&m) : m(std::move(m)) {}
 
@@ -59,31 +76,48 @@ public:
     }
 
     SDL_GL_SetSwapInterval(0);
+    SDL_GetRendererOutputSize(renderer.m.ren, &renderer.m.width,
+                              &renderer.m.height);
 
     return std::move(renderer);
   }
 
-  template <class Registry> void draw(ecs::basic_world<Registry> &world) {
-    int width;
-    int height;
-    SDL_GetRendererOutputSize(m.ren, &width, &height);
-    float half_width = width / 2.0;
-    float half_height = height / 2.0;
-
-    auto query = world.template query<components::pos>();
-    std::vector<SDL_FPoint> points;
-    for (auto [pos] : query) {
-      SDL_FPoint point{
-          .x = (half_width + pos.x),
-          .y = (half_height + pos.y),
-      };
-      points.push_back(point);
+  // Copies the positions to screen space in the back buffer, chunk by chunk
+  // and in parallel, then swaps the buffers. Points end up in no particular
+  // order. Can run on any thread, but not with submit().
+  template <class Registry> void extract(ecs::basic_world<Registry> &world) {
+    auto query = world.template query<const components::pos>();
+    auto &back = m.staging[m.back];
+    back.count = query.count();
+    if (back.points.size() < back.count) {
+      back.points.resize(back.count);
     }
 
+    const float half_width = m.width / 2.0f;
+    const float half_height = m.height / 2.0f;
+    std::atomic<std::size_t> cursor = 0;
+    query.par_for_each_chunk([&](std::span<const components::pos> pos) {
+      auto *points = back.points.data() +
+                     cursor.fetch_add(pos.size(), std::memory_order_relaxed);
+      for (std::size_t i = 0; i < pos.size(); i++) {
+        points[i] = {.x = half_width + pos[i].x, .y = half_height + pos[i].y};
+      }
+    });
+    m.back ^= 1;
+  }
+
+  // Draws the points of the last extract(), on the thread owning the
+  // renderer. It touches no component, so the next frame can be simulated
+  // meanwhile.
+  void submit() {
+    const auto &front = m.staging[m.back ^ 1];
+    SDL_GetRendererOutputSize(m.ren, &m.width, &m.height);
+
     SDL_SetRenderDrawColor(m.ren, 0x00, 0x00, 0x00, 0xff);
     SDL_RenderClear(m.ren);
     SDL_SetRenderDrawColor(m.ren, 0xff, 0xff, 0xff, 0xff);
-    SDL_RenderDrawPointsF(m.ren, points.data(), points.size());
+    SDL_RenderDrawPointsF(m.ren, front.points.data(),
+                          static_cast<int>(front.count));
     SDL_RenderPresent(m.ren);
   }
 
@@ -121,26 +155,33 @@ struct ParticleManager {
 
   template <class Registry>
   void create_particles(ecs::basic_world<Registry> &world, std::size_t amount) {
-    for (std::size_t i = 0; i < amount; i++) {
-      const auto [speed, pos, lifetime] = create_particle();
-
-      world.insert(pos, speed, lifetime);
-    }
+    world.template insert_batch<components::pos, components::speed,
+                                components::particule_info>(
+        amount, [&](std::size_t) {
+          const auto [speed, pos, lifetime] = create_particle();
+          return std::tuple{pos, speed, lifetime};
+        });
   }
 
   template <class Registry>
   void update(ecs::basic_world<Registry> &world, float dt) {
     auto query = world.template query<components::pos, components::speed,
                                       components::particule_info>();
-    for (auto [pos, speed, particule_info] : query) {
-      particule_info.lifetime -= dt;
-      if (particule_info.lifetime <= 0) {
-        const auto [new_speed, new_pos, new_lifetime] = create_particle();
-        pos = new_pos;
-        speed = new_speed;
-        particule_info = new_lifetime;
+    query.for_each_chunk([&](std::span<components::pos> pos,
+                             std::span<components::speed> speed,
+                             std::span<components::particule_info> info) {
+      for (std::size_t i = 0; i < pos.size(); i++) {
+        info[i].lifetime -= dt;
       }
-    }
+      for (std::size_t i = 0; i < pos.size(); i++) {
+        if (info[i].lifetime <= 0) {
+          const auto [new_speed, new_pos, new_lifetime] = create_particle();
+          pos[i] = new_pos;
+          speed[i] = new_speed;
+          info[i] = new_lifetime;
+        }
+      }
+    });
   }
 
 private:
@@ -171,12 +212,16 @@ using fsec = std::chrono::duration<float>;
 template <class Registry>
 void update_physics(ecs::basic_world<Registry> &world, float dt) {
   auto query = world.template query<components::pos, components::speed,
-                                    components::particule_info>();
-  for (auto [pos, speed, particule_info] : query) {
-    pos.x += speed.x * dt;
-    pos.y += speed.y * dt;
-    speed.y += 100.0f * dt / particule_info.mass;
-  }
+                                    const components::particule_info>();
+  query.par_for_each_chunk(
+      [&](std::span<components::pos> pos, std::span<components::speed> speed,
+          std::span<const components::particule_info> info) {
+        for (std::size_t i = 0; i < pos.size(); i++) {
+          pos[i].x += speed[i].x * dt;
+          pos[i].y += speed[i].y * dt;
+          speed[i].y += 100.0f * dt / info[i].mass;
+        }
+      });
 }
 
 int main() {
@@ -185,8 +230,10 @@ int main() {
     std::abort();
   }
 
-  ecs::basic_world<ecs::static_registry_from_list_t<components::list>> world{};
-  /* ecs::DynamicWorld world{}; */
+  using World =
+      ecs::basic_world<ecs::static_registry_from_list_t<components::list>>;
+  /* using World = ecs::DynamicWorld; */
+  World world{};
   Renderer renderer = INLINE_LAMBDA {
     auto renderer = Renderer::init();
     if (!renderer) {
@@ -199,7 +246,43 @@ int main() {
   particles.create_particles(world, 256 * 1024);
 
   float dt = 0.0;
+  ecs::scheduler<World> systems;
+  systems.add(
+      {
+          .name = "update physics",
+          .reads = world.reads_of<const components::particule_info>(),
+          .writes = world.writes_of<components::pos, components::speed>(),
+      },
+      [&](World &world) { update_physics(world, dt); });
+  systems.add(
+      {
+          .name = "update particles",
+          .reads = {},
+          .writes = world.as_type_set<components::pos, components::speed,
+                                      components::particule_info>(),
+      },
+      [&](World &world) { particles.update(world, dt); });
+  systems.add(
+      {
+          .name = "extract render",
+          .reads = world.reads_of<const components::pos>(),
+          .writes = {},
+      },
+      [&](World &world) { renderer.extract(world); });
+  // Draws the previous frame while this one is being simulated, see
+  // Renderer::submit.
+  systems.add(
+      {
+          .name = "render",
+          .reads = {},
+          .writes = {},
+          .pinned = true,
+      },
+      [&](World &) { renderer.submit(); });
+
+  auto &profiler = ecs::profiler::global();
   auto last = std::chrono::high_resolution_clock::now();
+  auto last_report = last;
   bool quit = false;
   while (!quit) {
     SDL_Event event;
@@ -213,14 +296,33 @@ int main() {
       }
     }
 
-    TIMED_INLINE_LAMBDA("update physics") { update_physics(world, dt); };
-    TIMED_INLINE_LAMBDA("update particles") { particles.update(world, dt); };
-    TIMED_INLINE_LAMBDA("render") { renderer.draw(world); };
+    {
+      ECS_PROFILE_SCOPE("frame");
+      systems.run(world);
+    }
 
     const auto previous =
         std::exchange(last, std::chrono::high_resolution_clock::now());
     dt = std::chrono::duration_cast<fsec>(last - previous).count();
-    nostd::println("FPS: {:.1f} \t|\t{:.2f}us", 1.0 / dt, 1000.*1000.*dt);
+
+    // Between frames: nothing is being recorded.
+    if (last - last_report >= std::chrono::seconds{1}) {
+      last_report = last;
+      for (const auto &s : profiler.summary()) {
+        nostd::println("{:>40}: {:>6} x avg {:>9.1f}us p99 {:>9.1f}us", s.name,
+                       s.count, s.avg_us, s.p99_us);
+      }
+      nostd::println("");
+      if (std::getenv("ECS_TRACE") == nullptr) {
+        profiler.clear();
+      }
+    }
+  }
+
+  // The last events, up to profiler::ring_capacity per thread.
+  if (const auto *path = std::getenv("ECS_TRACE")) {
+    std::ofstream trace{path};
+    profiler.write_chrome_trace(trace);
   }
 
   SDL_Quit();
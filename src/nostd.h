@@ -3,13 +3,13 @@
 #include <algorithm>
 #include <array>
 #include <cassert>
-#include <chrono>
 #include <cstddef>
 #include <cstdio>
 #include <cstring>
 #include <cxxabi.h>
 #include <format>
 #include <functional>
+#include <type_traits>
 #include <utility>
 
 namespace nostd {
@@ -54,6 +54,35 @@ template <class A, class... Tn> struct index_of<A, typelist<Tn...>> {
 template <class A, class T>
 inline constexpr size_t index_of_v = index_of<A, T>::value;
 
+template <class... T> struct concat {
+  using type = typelist<>;
+};
+template <class... A> struct concat<typelist<A...>> {
+  using type = typelist<A...>;
+};
+template <class... A, class... B, class... Rest>
+struct concat<typelist<A...>, typelist<B...>, Rest...> {
+  using type = concat<typelist<A..., B...>, Rest...>::type;
+};
+template <class... T> using concat_t = concat<T...>::type;
+
+// The types of T for which Pred<T>::value holds, in order.
+template <template <class> class Pred, class T> struct filter {};
+template <template <class> class Pred, class... Tn>
+struct filter<Pred, typelist<Tn...>> {
+  using type = concat_t<
+      std::conditional_t<Pred<Tn>::value, typelist<Tn>, typelist<>>...>;
+};
+template <template <class> class Pred, class T>
+using filter_t = filter<Pred, T>::type;
+
+static_assert(std::is_same_v<filter_t<std::is_integral, typelist<int, float>>,
+                             typelist<int>>);
+
+constexpr std::size_t align_up(std::size_t value, std::size_t alignment) {
+  return (value + alignment - 1) / alignment * alignment;
+}
+
 template <class T> char *type_name() {
   return abi::__cxa_demangle(typeid(T).name(), nullptr, nullptr, nullptr);
 }
@@ -101,29 +130,9 @@ struct inline_lambda {
   template <class Fn> auto operator+(Fn &&f) { return f(); }
 };
 
-struct timed_inline_lambda {
-  std::string_view name;
-
-  template <class Fn> auto operator+(Fn &&f) {
-    const auto start = std::chrono::high_resolution_clock::now();
-    f();
-    const auto end = std::chrono::high_resolution_clock::now();
-    float duration_s =
-        std::chrono::duration_cast<std::chrono::duration<float>>(end - start)
-            .count();
-    nostd::println("{}: {:.0f}us", name, duration_s * 1000 * 1000);
-  }
-};
-
 template <class Fn, class T, T... ints>
 void static_for(std::integer_sequence<T, ints...>, Fn &&f) {
   (std::invoke(f, ints), ...);
 };
 } // namespace nostd
 #define INLINE_LAMBDA nostd::inline_lambda{} + [&]()
-
-#ifdef TIMED_INLINE_LAMBDA_DISABLE
-#define TIMED_INLINE_LAMBDA(name) nostd::inline_lambda{} + [&]()
-#else
-#define TIMED_INLINE_LAMBDA(name) nostd::timed_inline_lambda{(name)} + [&]()
-#endif
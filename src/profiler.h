@@ -0,0 +1,256 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace ecs {
+
+// Timed scopes recorded in a ring buffer per thread, cheap enough to stay on:
+// opening and closing a scope reads the timestamp counter twice and writes one
+// event, without locking nor allocating once the ring of the thread exists.
+//
+// Scopes nest, each event keeps its depth. The rings only hold the last
+// `ring_capacity` events of each thread: summary() and write_chrome_trace()
+// look at those, and must not run while other threads record, e.g. call them
+// between frames.
+class profiler {
+public:
+  struct event {
+    // Must outlive the profiler, usually a literal, see intern().
+    const char *name;
+    std::uint64_t begin;
+    std::uint64_t end;
+    std::uint32_t depth;
+  };
+
+  struct scope_stats {
+    std::string_view name;
+    std::size_t count;
+    double total_us;
+    double min_us;
+    double avg_us;
+    double p99_us;
+    double max_us;
+  };
+
+  static constexpr std::size_t ring_capacity = 1 << 16;
+
+  static std::uint64_t now() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+  }
+
+  profiler() : start_(now()), start_time_(clock::now()) {}
+  profiler(const profiler &) = delete;
+  profiler &operator=(const profiler &) = delete;
+
+  static profiler &global() {
+    static profiler p;
+    return p;
+  }
+
+  // A copy of `name` that is never freed, the same for equal names: scopes of
+  // names made at runtime, e.g. system names, stay readable by summary()
+  // after the string they come from is gone.
+  static const char *intern(std::string_view name) {
+    struct interned {
+      std::mutex mutex;
+      std::unordered_set<std::string> set;
+    };
+    // Leaked so that it outlives the global profiler.
+    static auto *const names = new interned;
+    std::scoped_lock lock{names->mutex};
+    return names->set.emplace(name).first->c_str();
+  }
+
+  bool enabled() const { return enabled_.load(std::memory_order_relaxed); }
+  void set_enabled(bool enabled) {
+    enabled_.store(enabled, std::memory_order_relaxed);
+  }
+
+  void record(const event &e) {
+    auto &r = own_ring();
+    r.events[r.head % ring_capacity] = e;
+    r.head++;
+  }
+
+  // Nesting depth of the scopes open on the calling thread.
+  static std::uint32_t &depth() {
+    static thread_local std::uint32_t d = 0;
+    return d;
+  }
+
+  // Durations of the recorded scopes aggregated by name, by decreasing total.
+  std::vector<scope_stats> summary() {
+    const auto us_per_tick = calibrate();
+    std::unordered_map<std::string_view, std::vector<double>> durations;
+    for_each_event([&](const event &e, std::size_t) {
+      durations[e.name].push_back((e.end - e.begin) * us_per_tick);
+    });
+
+    std::vector<scope_stats> out;
+    for (auto &[name, d] : durations) {
+      std::ranges::sort(d);
+      double total = 0;
+      for (const auto v : d) {
+        total += v;
+      }
+      out.push_back({
+          .name = name,
+          .count = d.size(),
+          .total_us = total,
+          .min_us = d.front(),
+          .avg_us = total / d.size(),
+          .p99_us = d[(d.size() - 1) * 99 / 100],
+          .max_us = d.back(),
+      });
+    }
+    std::ranges::sort(out, std::ranges::greater{}, &scope_stats::total_us);
+    return out;
+  }
+
+  // The recorded events in the Chrome trace event format, to be opened in
+  // chrome://tracing or Perfetto.
+  void write_chrome_trace(std::ostream &out) {
+    const auto us_per_tick = calibrate();
+    out << "{\"traceEvents\":[";
+    bool first = true;
+    for_each_event([&](const event &e, std::size_t thread) {
+      out << (first ? "\n" : ",\n") << "{\"name\":\"";
+      first = false;
+      for (const auto c : std::string_view{e.name}) {
+        if (c == '"' || c == '\\') {
+          out << '\\';
+        }
+        out << c;
+      }
+      out << "\",\"ph\":\"X\",\"pid\":0,\"tid\":" << thread
+          << ",\"ts\":" << (e.begin - start_) * us_per_tick
+          << ",\"dur\":" << (e.end - e.begin) * us_per_tick << "}";
+    });
+    out << "\n]}\n";
+  }
+
+  // Drops the recorded events, same restrictions as summary().
+  void clear() {
+    std::scoped_lock lock{mutex_};
+    for (auto &r : rings_) {
+      r->head = 0;
+    }
+  }
+
+private:
+  using clock = std::chrono::steady_clock;
+
+  struct ring {
+    std::vector<event> events = std::vector<event>(ring_capacity);
+    std::uint64_t head = 0;
+  };
+
+  std::atomic<bool> enabled_ = true;
+  std::uint64_t start_;
+  clock::time_point start_time_;
+
+  std::mutex mutex_;
+  std::vector<std::unique_ptr<ring>> rings_;
+  const std::uint64_t id_ = next_id();
+
+  static std::uint64_t next_id() {
+    static std::atomic<std::uint64_t> next = 0;
+    return next++;
+  }
+
+  ring &own_ring() {
+    thread_local std::vector<std::pair<std::uint64_t, ring *>> cache;
+    for (const auto &[id, r] : cache) {
+      if (id == id_) {
+        return *r;
+      }
+    }
+
+    std::scoped_lock lock{mutex_};
+    auto &r = rings_.emplace_back(std::make_unique<ring>());
+    cache.emplace_back(id_, r.get());
+    return *r;
+  }
+
+  // Calls `fn(event, thread)` for the events still in the rings.
+  template <class Fn> void for_each_event(Fn &&fn) {
+    std::scoped_lock lock{mutex_};
+    for (std::size_t t = 0; t < rings_.size(); t++) {
+      const auto &r = *rings_[t];
+      const auto first = r.head > ring_capacity ? r.head - ring_capacity : 0;
+      for (auto i = first; i < r.head; i++) {
+        fn(r.events[i % ring_capacity], t);
+      }
+    }
+  }
+
+  // Microseconds per timestamp tick, measured from the profiler creation.
+  double calibrate() const {
+    const auto ticks = now() - start_;
+    const auto elapsed =
+        std::chrono::duration<double, std::micro>(clock::now() - start_time_);
+    return ticks == 0 ? 0 : elapsed.count() / ticks;
+  }
+};
+
+// Records the time spent until the end of the scope under `name`.
+class profile_scope {
+  profiler *profiler_;
+  const char *name_;
+  std::uint64_t begin_;
+
+public:
+  explicit profile_scope(const char *name,
+                         profiler &p = profiler::global())
+      : profiler_(p.enabled() ? &p : nullptr), name_(name), begin_(0) {
+    if (profiler_ != nullptr) {
+      profiler::depth()++;
+      begin_ = profiler::now();
+    }
+  }
+  ~profile_scope() {
+    if (profiler_ != nullptr) {
+      const auto end = profiler::now();
+      profiler_->record({
+          .name = name_,
+          .begin = begin_,
+          .end = end,
+          .depth = --profiler::depth(),
+      });
+    }
+  }
+
+  profile_scope(const profile_scope &) = delete;
+  profile_scope &operator=(const profile_scope &) = delete;
+};
+} // namespace ecs
+
+#define ECS_PROFILE_CONCAT_(a, b) a##b
+#define ECS_PROFILE_CONCAT(a, b) ECS_PROFILE_CONCAT_(a, b)
+#ifdef ECS_PROFILE_DISABLE
+#define ECS_PROFILE_SCOPE(name)
+#else
+#define ECS_PROFILE_SCOPE(name)                                                \
+  ecs::profile_scope ECS_PROFILE_CONCAT(profile_scope_, __LINE__) { (name) }
+#endif
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "profiler.h"
+#include "thread_pool.h"
+
+namespace ecs {
+
+// Runs systems in registration order, except that systems whose component
+// accesses do not conflict run at the same time. Each system run is recorded
+// by the global profiler under the name of the system.
+//
+// Two systems conflict when one writes a component the other reads or
+// writes. Each system depends on the earlier systems it conflicts with; the
+// systems are then grouped in levels, a level only containing systems whose
+// dependencies are in the previous levels.
+template <class World> class scheduler {
+public:
+  using type_set = World::type_set;
+
+  struct system_info {
+    std::string name;
+    // See basic_world::reads_of and basic_world::writes_of.
+    type_set reads;
+    type_set writes;
+    // Run on the thread calling run(), e.g. for rendering.
+    bool pinned = false;
+  };
+
+  void add(system_info info, std::function<void(World &)> fn) {
+    const auto *name = profiler::intern(info.name);
+    systems_.push_back({std::move(info), std::move(fn), name});
+    levels_.clear();
+  }
+
+  void run(World &world, thread_pool &pool = thread_pool::global()) {
+    if (levels_.empty()) {
+      build();
+    }
+
+    const auto run_system = [&](std::size_t s) {
+      ECS_PROFILE_SCOPE(systems_[s].name);
+      systems_[s].fn(world);
+    };
+    for (const auto &level : levels_) {
+      pool.parallel_for(
+          level.free.size(), [&](std::size_t i) { run_system(level.free[i]); },
+          [&] {
+            for (const auto s : level.pinned) {
+              run_system(s);
+            }
+          });
+    }
+
+    // End of frame: the structural changes recorded by the systems apply.
+    ECS_PROFILE_SCOPE("flush");
+    world.flush();
+  }
+
+private:
+  struct system {
+    system_info info;
+    std::function<void(World &)> fn;
+    // info.name as recorded by the profiler, see profiler::intern.
+    const char *name;
+  };
+
+  struct level {
+    std::vector<std::size_t> free;
+    std::vector<std::size_t> pinned;
+  };
+
+  std::vector<system> systems_;
+  std::vector<level> levels_;
+
+  static bool conflicts(const system_info &a, const system_info &b) {
+    return (a.writes & (b.reads | b.writes)).any() ||
+           (b.writes & a.reads).any();
+  }
+
+  void build() {
+    std::vector<std::size_t> level_of(systems_.size(), 0);
+    for (std::size_t j = 0; j < systems_.size(); j++) {
+      for (std::size_t i = 0; i < j; i++) {
+        if (conflicts(systems_[i].info, systems_[j].info)) {
+          level_of[j] = std::max(level_of[j], level_of[i] + 1);
+        }
+      }
+
+      if (level_of[j] >= levels_.size()) {
+        levels_.resize(level_of[j] + 1);
+      }
+      auto &l = levels_[level_of[j]];
+      (systems_[j].info.pinned ? l.pinned : l.free).push_back(j);
+    }
+  }
+};
+} // namespace ecs
@@ -0,0 +1,475 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cassert>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <ostream>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "chunk_allocator.h"
+#include "ecs.h"
+
+namespace ecs {
+
+// A snapshot is the memory of a world as is: its entity table, the raw
+// chunks of its archetypes and its sparse sets. Restoring one costs about as
+// much as reading the file, but it can only be read back by a build laying
+// out the same registry the same way, on the same platform.
+//
+// In order, each record aligned on its own alignment:
+//   snapshot_header
+//   entity_location[header.entities], std::uint32_t[header.free_entities]
+//   per archetype:    snapshot_archetype
+//   per chunk of it:  snapshot_chunk, then if the chunk has storage
+//                     std::uint64_t[occupancy words] and the chunk storage,
+//                     aligned on the archetype layout alignment
+//   per sparse set:   snapshot_sparse_set, std::uint32_t[count],
+//                     change_ticks[count] and the components, aligned on
+//                     the component alignment
+struct snapshot_header {
+  static constexpr std::array<char, 8> expected_magic = {'E', 'C', 'S', 'S',
+                                                         'N', 'A', 'P', 0};
+  static constexpr std::uint32_t current_version = 4;
+
+  std::array<char, 8> magic;
+  std::uint32_t version;
+  std::uint32_t max_components;
+  std::uint64_t tick;
+  std::uint64_t entities;
+  std::uint64_t free_entities;
+  std::uint64_t archetypes;
+  std::uint64_t sparse_sets;
+};
+
+template <const std::size_t N> struct snapshot_archetype {
+  typename type_set<N>::words_t types;
+  archetype_layout<N> layout;
+  std::uint64_t dense;
+  std::uint64_t chunks;
+};
+
+struct snapshot_chunk {
+  // Chunks released by their hive have no storage.
+  std::uint64_t allocated;
+};
+
+struct snapshot_sparse_set {
+  std::uint64_t type_index;
+  std::uint64_t size;
+  std::uint64_t alignment;
+  std::uint64_t count;
+};
+
+// Writes records to a stream, padding them to their alignment relative to the
+// start of the stream.
+class snapshot_writer {
+  std::ostream *out_;
+  std::size_t pos_ = 0;
+
+public:
+  explicit snapshot_writer(std::ostream &out) : out_(&out) {}
+
+  std::size_t pos() const { return pos_; }
+
+  void align(std::size_t alignment) {
+    static constexpr std::array<char, 64> zeros{};
+    auto padding = nostd::align_up(pos_, alignment) - pos_;
+    while (padding > 0) {
+      const auto n = std::min(padding, zeros.size());
+      bytes(zeros.data(), n);
+      padding -= n;
+    }
+  }
+  void bytes(const void *data, std::size_t size) {
+    out_->write(static_cast<const char *>(data),
+                static_cast<std::streamsize>(size));
+    pos_ += size;
+  }
+  template <class T> void write(const T &value) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    align(alignof(T));
+    bytes(&value, sizeof(T));
+  }
+  template <class T> void write(std::span<const T> values) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    align(alignof(T));
+    bytes(values.data(), values.size_bytes());
+  }
+};
+
+// Reads records written by snapshot_writer out of memory, in place.
+class snapshot_reader {
+  std::span<std::byte> data_;
+  std::size_t pos_ = 0;
+
+public:
+  explicit snapshot_reader(std::span<std::byte> data) : data_(data) {}
+
+  std::size_t pos() const { return pos_; }
+  bool done() const { return pos_ == data_.size(); }
+
+  // The next `size` bytes aligned on `alignment`.
+  std::byte *take(std::size_t size, std::size_t alignment) {
+    const auto begin = nostd::align_up(pos_, alignment);
+    if (begin > data_.size() || data_.size() - begin < size) {
+      throw std::runtime_error("truncated snapshot");
+    }
+    pos_ = begin + size;
+    return data_.data() + begin;
+  }
+  template <class T> T read() {
+    static_assert(std::is_trivially_copyable_v<T>);
+    T value;
+    std::memcpy(&value, take(sizeof(T), alignof(T)), sizeof(T));
+    return value;
+  }
+  template <class T> std::span<const T> read(std::size_t count) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    if (count > data_.size() / sizeof(T)) {
+      throw std::runtime_error("truncated snapshot");
+    }
+    return {reinterpret_cast<const T *>(take(count * sizeof(T), alignof(T))),
+            count};
+  }
+};
+
+// Whether `a` and `b` lay the components of `types` and the entities out
+// the same way.
+template <const std::size_t N>
+bool same_layout(const archetype_layout<N> &a, const archetype_layout<N> &b,
+                 const type_set<N> &types) {
+  const auto same = [](const column_layout &x, const column_layout &y) {
+    return x.offset == y.offset && x.stride == y.stride && x.size == y.size &&
+           x.ticks == y.ticks;
+  };
+  bool out = a.mode == b.mode && a.chunk_size == b.chunk_size &&
+             a.alignment == b.alignment && a.capacity == b.capacity &&
+             a.column_alignment == b.column_alignment &&
+             a.chunk_bytes == b.chunk_bytes && same(a.entities, b.entities);
+  types.for_each(
+      [&](std::size_t i) { out = out && same(a.columns[i], b.columns[i]); });
+  return out;
+}
+
+// Appends to `world` an empty archetype as described by `record`, whose
+// layout must be the one `world` makes for its types.
+template <class Registry>
+typename basic_world<Registry>::archetype &
+restore_archetype(basic_world<Registry> &world,
+                  const snapshot_archetype<Registry::max_components> &record) {
+  constexpr auto N = Registry::max_components;
+  const type_set<N> types{record.types};
+  const auto &layout = record.layout;
+  bool valid = (layout.mode == storage_mode::rows ||
+                layout.mode == storage_mode::columns) &&
+               std::has_single_bit(layout.column_alignment) &&
+               layout.chunk_bytes <= std::numeric_limits<std::uint32_t>::max();
+  types.for_each([&](std::size_t i) {
+    valid = valid && i < world.registry.count() &&
+            world.registry.storage(i) == storage_policy::table;
+  });
+  if (!valid || world.archetypes_by_types_.contains(types) ||
+      !same_layout(world.layout_of(types, layout.mode, layout.column_alignment,
+                                   layout.chunk_bytes),
+                   layout, types)) {
+    throw std::runtime_error("snapshot of another registry");
+  }
+
+  return world.archetypes_[world.add_archetype(types, layout,
+                                               record.dense != 0)];
+}
+
+// Throws `error` unless the live entities of the entity table of `world` and
+// the entities of its archetypes point at each other, one to one.
+template <class Registry>
+void check_entities(basic_world<Registry> &world, const char *error) {
+  using world_t = basic_world<Registry>;
+  const auto fail = [&] { throw std::runtime_error(error); };
+  std::vector<bool> free(world.entities_.size());
+  for (const auto index : world.free_entities_) {
+    if (index >= free.size() || free[index]) {
+      fail();
+    }
+    free[index] = true;
+  }
+
+  std::size_t live = 0;
+  for (std::size_t i = 0; i < world.entities_.size(); i++) {
+    const auto &location = world.entities_[i];
+    // Retired indices are not free either, see basic_world::despawn.
+    if (free[i] || location.generation == world_t::max_generation) {
+      continue;
+    }
+    live++;
+    if (location.archetype >= world.archetypes_.size()) {
+      fail();
+    }
+    auto &archetype = world.archetypes_[location.archetype];
+    const auto info = hive_entry_info_t::from_hive_index(location.idx);
+    const auto chunks = archetype.data.chunks();
+    if (info.chunk >= chunks.size()) {
+      fail();
+    }
+    auto &chunk = chunks[info.chunk];
+    if (!chunk.allocated() || info.chunk_index >= chunk.top ||
+        !chunk.live(info.chunk_index) ||
+        archetype.entity_at(chunk.slot(info.chunk_index)) != i) {
+      fail();
+    }
+  }
+
+  std::size_t stored = 0;
+  for (const auto &archetype : world.archetypes_) {
+    for (const auto &c : archetype.data.chunks()) {
+      stored += c.size;
+    }
+  }
+  if (stored != live) {
+    fail();
+  }
+}
+
+// The sparse set of `world` described by `record`, which must match the
+// registry.
+template <class Registry>
+sparse_set &restored_sparse_set(basic_world<Registry> &world,
+                                const snapshot_sparse_set &record) {
+  if (record.type_index >= Registry::max_components ||
+      world.registry.storage(record.type_index) !=
+          storage_policy::sparse_set ||
+      record.size != world.registry.size(record.type_index) ||
+      record.alignment != world.registry.alignment(record.type_index)) {
+    throw std::runtime_error("snapshot of another registry");
+  }
+  return world.sparse_set_of(record.type_index);
+}
+
+// Writes `world` to `out`, no query may be iterating meanwhile. Pending
+// commands are not part of the snapshot.
+template <class Registry>
+void save_snapshot(const basic_world<Registry> &world, std::ostream &out) {
+  constexpr auto N = Registry::max_components;
+  const auto sparse_sets = std::ranges::count_if(
+      world.sparse_sets_, [](const auto &set) { return set != nullptr; });
+  snapshot_writer w{out};
+  w.write(snapshot_header{
+      .magic = snapshot_header::expected_magic,
+      .version = snapshot_header::current_version,
+      .max_components = static_cast<std::uint32_t>(N),
+      .tick = world.tick(),
+      .entities = world.entities_.size(),
+      .free_entities = world.free_entities_.size(),
+      .archetypes = world.archetypes_.size(),
+      .sparse_sets = static_cast<std::uint64_t>(sparse_sets),
+  });
+  w.write(std::span<const entity_location>{world.entities_});
+  w.write(std::span<const std::uint32_t>{world.free_entities_});
+
+  for (const auto &archetype : world.archetypes_) {
+    const auto chunks = archetype.data.chunks();
+    w.write(snapshot_archetype<N>{
+        .types = archetype.types.words(),
+        .layout = archetype.layout,
+        .dense = archetype.dense,
+        .chunks = chunks.size(),
+    });
+    for (const auto &c : chunks) {
+      w.write(snapshot_chunk{.allocated = c.allocated()});
+      if (!c.allocated()) {
+        continue;
+      }
+      w.write(std::span<const std::uint64_t>{c.occupied.get(), c.words()});
+      w.align(archetype.layout.alignment);
+      w.bytes(c.data.get(), archetype.layout.chunk_size);
+    }
+  }
+
+  for (std::size_t i = 0; i < N; i++) {
+    const auto *set = world.sparse_sets_[i].get();
+    if (set == nullptr) {
+      continue;
+    }
+    w.write(snapshot_sparse_set{
+        .type_index = i,
+        .size = set->component_size(),
+        .alignment = set->alignment(),
+        .count = set->size(),
+    });
+    w.write(set->entities());
+    w.write(set->all_ticks());
+    w.align(set->alignment());
+    w.bytes(set->bytes().data(), set->bytes().size());
+  }
+}
+
+template <class Registry>
+void save_snapshot(const basic_world<Registry> &world, const char *path) {
+  std::ofstream out{path, std::ios::binary | std::ios::trunc};
+  if (!out) {
+    throw std::system_error(errno, std::generic_category(), path);
+  }
+  save_snapshot(world, out);
+  out.flush();
+  if (!out) {
+    throw std::system_error(errno, std::generic_category(), path);
+  }
+}
+
+// A snapshot file mapped in memory, to restore worlds from.
+//
+// Restored chunks are either copied out of the mapping, or adopted: they keep
+// pointing into the mapping, which is private so that writing to them copies
+// the touched pages instead of changing the file. Adopted chunks give their
+// storage back to the snapshot_file, which must then outlive the world, and
+// the storage they get once released and reused comes from `fallback`.
+class snapshot_file final : public chunk_allocator {
+  std::byte *data_ = nullptr;
+  std::size_t size_ = 0;
+  chunk_allocator *fallback_;
+
+  bool owns(const std::byte *p) const {
+    return p >= data_ && p < data_ + size_;
+  }
+
+public:
+  explicit snapshot_file(
+      const char *path,
+      chunk_allocator &fallback = heap_chunk_allocator::instance())
+      : fallback_(&fallback) {
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+      throw std::system_error(errno, std::generic_category(), path);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+      const auto error = errno;
+      close(fd);
+      throw std::system_error(error, std::generic_category(), path);
+    }
+
+    size_ = static_cast<std::size_t>(st.st_size);
+    void *mapped = size_ == 0 ? MAP_FAILED
+                              : mmap(nullptr, size_, PROT_READ | PROT_WRITE,
+                                     MAP_PRIVATE, fd, 0);
+    const auto error = errno;
+    close(fd);
+    if (mapped == MAP_FAILED) {
+      throw std::system_error(size_ == 0 ? EINVAL : error,
+                              std::generic_category(), path);
+    }
+    data_ = static_cast<std::byte *>(mapped);
+  }
+
+  ~snapshot_file() override { munmap(data_, size_); }
+
+  snapshot_file(const snapshot_file &) = delete;
+  snapshot_file &operator=(const snapshot_file &) = delete;
+
+  std::span<std::byte> bytes() { return {data_, size_}; }
+
+  std::byte *allocate(std::size_t bytes, std::size_t alignment) override {
+    return fallback_->allocate(bytes, alignment);
+  }
+  void deallocate(std::byte *p, std::size_t bytes,
+                  std::size_t alignment) override {
+    if (!owns(p)) {
+      fallback_->deallocate(p, bytes, alignment);
+    }
+  }
+
+  // Fills `world`, which must be empty, with the snapshot: one memcpy per
+  // chunk, or none if `adopt`. The registry of `world` must give the same
+  // components the same type indices as the one of the saved world, e.g. a
+  // DynamicRegistry must register them in the same order.
+  template <class Registry>
+  void restore(basic_world<Registry> &world, bool adopt = false) {
+    constexpr auto N = Registry::max_components;
+    assert(world.entities_.empty() && world.archetypes_.empty());
+    if (!adopt) {
+      madvise(data_, size_, MADV_SEQUENTIAL);
+    }
+
+    snapshot_reader r{bytes()};
+    const auto header = r.read<snapshot_header>();
+    if (header.magic != snapshot_header::expected_magic ||
+        header.version != snapshot_header::current_version) {
+      throw std::runtime_error("not a snapshot");
+    }
+    if (header.max_components != N) {
+      throw std::runtime_error("snapshot of another registry");
+    }
+
+    const auto entities = r.read<entity_location>(header.entities);
+    const auto free_entities = r.read<std::uint32_t>(header.free_entities);
+    world.entities_.assign(entities.begin(), entities.end());
+    world.free_entities_.assign(free_entities.begin(), free_entities.end());
+    world.tick_.store(header.tick, std::memory_order_relaxed);
+
+    world.archetypes_.reserve(header.archetypes);
+    for (std::size_t a = 0; a < header.archetypes; a++) {
+      const auto record = r.read<snapshot_archetype<N>>();
+      auto &archetype = restore_archetype(world, record);
+      if (record.chunks > std::numeric_limits<std::uint32_t>::max()) {
+        throw std::runtime_error("corrupt snapshot");
+      }
+      const auto capacity = record.layout.capacity;
+      const auto words = (capacity + 63) / 64;
+      for (std::size_t c = 0; c < record.chunks; c++) {
+        if (r.read<snapshot_chunk>().allocated == 0) {
+          archetype.data.restore_chunk(c, {});
+          continue;
+        }
+        const auto occupied = r.read<std::uint64_t>(words);
+        if (capacity % 64 != 0 && occupied.back() >> (capacity % 64) != 0) {
+          throw std::runtime_error("corrupt snapshot");
+        }
+        auto *storage =
+            r.take(record.layout.chunk_size, record.layout.alignment);
+        // The mapping is only page aligned.
+        if (adopt && reinterpret_cast<std::uintptr_t>(storage) %
+                             record.layout.alignment ==
+                         0) {
+          archetype.data.restore_chunk(c, occupied, storage, this);
+        } else {
+          auto &chunk = archetype.data.restore_chunk(c, occupied);
+          std::memcpy(chunk.data.get(), storage, record.layout.chunk_size);
+        }
+      }
+    }
+
+    for (std::size_t s = 0; s < header.sparse_sets; s++) {
+      const auto record = r.read<snapshot_sparse_set>();
+      auto &set = restored_sparse_set(world, record);
+      const auto entities = r.read<std::uint32_t>(record.count);
+      std::vector<bool> seen(world.entities_.size());
+      for (const auto index : entities) {
+        if (index >= seen.size() || seen[index]) {
+          throw std::runtime_error("corrupt snapshot");
+        }
+        seen[index] = true;
+      }
+      const auto ticks = r.read<change_ticks>(record.count);
+      const auto size = record.count * set.stride();
+      set.assign(entities, ticks, {r.take(size, set.alignment()), size});
+    }
+    check_entities(world, "corrupt snapshot");
+  }
+};
+
+} // namespace ecs
@@ -0,0 +1,244 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <span>
+#include <vector>
+
+#include "ecs.h"
+
+namespace ecs {
+
+// A uniform grid over the `Pos` components of a world, for range and
+// neighbor queries. `Pos` has float `x` and `y` members.
+//
+// Cells of `cell_size` are mapped to as many buckets as there are entities,
+// so the grid is unbounded and takes O(n) memory. The entities are packed
+// bucket after bucket along with their position: a query reads a contiguous
+// range per cell it overlaps, and gets the matching entities in batches.
+//
+// Buckets keep neighbor cells close: the cells are grouped in tiles of as
+// many cells as there are buckets, and each tile is laid out row after row
+// from a bucket its coordinates hash to. The cells of a row of a tile are in
+// consecutive buckets, and so are its rows, so that neighbor queries read a
+// few contiguous runs of entities.
+//
+// There is no incremental update: the grid is rebuilt from scratch as soon as
+// one position changed, i.e. every frame for moving entities.
+template <class World, class Pos> class spatial_grid {
+  static_assert(!is_sparse_v<Pos>, "positions are read from the archetypes");
+
+public:
+  struct entry {
+    entity_t entity;
+    float x;
+    float y;
+  };
+
+  // Entities handed to a query callback at once, at most.
+  static constexpr std::size_t batch_size = 64;
+
+  explicit spatial_grid(float cell_size)
+      : cell_size_(cell_size), inverse_(1 / cell_size) {}
+
+  float cell_size() const { return cell_size_; }
+  // All the entities, bucket after bucket.
+  std::span<const entry> entries() const { return entries_; }
+
+  // Rebuilds the whole grid if a `Pos` was given, changed or taken since the
+  // last update. No query may be iterating meanwhile.
+  void update(World &world) {
+    // Changes made from now on have a later tick.
+    const auto now = world.tick_.fetch_add(1, std::memory_order_relaxed);
+    const auto type_index = world.registry.template index<Pos>();
+    std::size_t count = 0;
+    bool changed = false;
+    for_each_chunk(world, [&](auto &archetype, chunk &c) {
+      const auto &ticks = archetype.ticks(c.slot(0), type_index);
+      changed |= ticks.changed > since_ || ticks.added > since_;
+      count += c.size;
+    });
+    changed |= count != entries_.size();
+    since_ = now;
+    if (changed) {
+      rebuild(world, count);
+    }
+  }
+
+  // Calls `fn(std::span<const entry>)` with the entities whose position is
+  // in the box [min_x, max_x] x [min_y, max_y], in batches. Can run
+  // concurrently with other queries.
+  template <class Fn>
+  void query_box(float min_x, float min_y, float max_x, float max_y,
+                 Fn &&fn) const {
+    visit(min_x, min_y, max_x, max_y, fn, [&](const entry &e) {
+      return e.x >= min_x && e.x <= max_x && e.y >= min_y && e.y <= max_y;
+    });
+  }
+
+  // Same as query_box, for the entities at most `radius` away from
+  // (`x`, `y`).
+  template <class Fn>
+  void query_radius(float x, float y, float radius, Fn &&fn) const {
+    const auto r2 = radius * radius;
+    visit(x - radius, y - radius, x + radius, y + radius, fn,
+          [&](const entry &e) {
+            const auto dx = e.x - x;
+            const auto dy = e.y - y;
+            return dx * dx + dy * dy <= r2;
+          });
+  }
+
+private:
+  float cell_size_;
+  float inverse_;
+  // entries_[first_[b], first_[b + 1]) are the entities of bucket b.
+  std::vector<std::uint32_t> first_ = {0};
+  std::vector<entry> entries_;
+  std::uint64_t since_ = 0;
+  // Tiles are 2^tile_bits_x_ cells wide, 2^tile_bits_y_ high.
+  std::uint32_t tile_bits_x_ = 0;
+  std::uint32_t tile_bits_y_ = 0;
+
+  // Cells past the int32 range, infinities included, are merged into the ones
+  // at its ends, and NaN into cell 0.
+  std::int32_t cell_of(float v) const {
+    using limits = std::numeric_limits<std::int32_t>;
+    const double c = std::floor(v * inverse_);
+    if (std::isnan(c)) {
+      return 0;
+    }
+    return static_cast<std::int32_t>(std::clamp<double>(c, limits::min(),
+                                                        limits::max()));
+  }
+  std::size_t bucket_of(std::int32_t cx, std::int32_t cy) const {
+    const auto x = static_cast<std::uint32_t>(cx);
+    const auto y = static_cast<std::uint32_t>(cy);
+    const auto tile =
+        (x >> tile_bits_x_) * 0x9e3779b1u ^ (y >> tile_bits_y_) * 0x85ebca77u;
+    const auto in_tile = (y & ((1u << tile_bits_y_) - 1)) << tile_bits_x_ |
+                         (x & ((1u << tile_bits_x_) - 1));
+    return (tile + in_tile) & (first_.size() - 2);
+  }
+
+  template <class Fn> static void for_each_chunk(World &world, Fn &&fn) {
+    const auto type_index = world.registry.template index<Pos>();
+    for (auto &archetype : world.archetypes_) {
+      if (!archetype.types.test(type_index)) {
+        continue;
+      }
+      for (auto &c : archetype.data.chunks()) {
+        if (c.size != 0) {
+          fn(archetype, c);
+        }
+      }
+    }
+  }
+
+  void rebuild(World &world, std::size_t count) {
+    ECS_PROFILE_SCOPE("spatial_grid::rebuild");
+    const auto type_index = world.registry.template index<Pos>();
+    std::vector<entry> unsorted;
+    unsorted.reserve(count);
+    for_each_chunk(world, [&](auto &archetype, chunk &c) {
+      c.for_each_run([&](std::size_t begin, std::size_t end) {
+        for (auto i = begin; i < end; i++) {
+          const auto slot = c.slot(static_cast<std::uint32_t>(i));
+          const auto index = archetype.entity_at(slot);
+          const auto &p =
+              *reinterpret_cast<const Pos *>(archetype.at(slot, type_index));
+          unsorted.push_back({
+              .entity = entity_info{
+                  .index = index,
+                  .generation = world.entities_[index].generation,
+              }
+                            .into_entity_t(),
+              .x = p.x,
+              .y = p.y,
+          });
+        }
+      });
+    });
+
+    // Counting sort by bucket, a power of two of them.
+    const auto buckets = std::bit_ceil(std::max<std::size_t>(count, 1));
+    first_.assign(buckets + 1, 0);
+    const auto bits = static_cast<std::uint32_t>(std::countr_zero(buckets));
+    tile_bits_x_ = (bits + 1) / 2;
+    tile_bits_y_ = bits / 2;
+    std::vector<std::uint32_t> bucket(count);
+    for (std::size_t i = 0; i < count; i++) {
+      bucket[i] = static_cast<std::uint32_t>(
+          bucket_of(cell_of(unsorted[i].x), cell_of(unsorted[i].y)));
+      first_[bucket[i] + 1]++;
+    }
+    for (std::size_t b = 0; b < buckets; b++) {
+      first_[b + 1] += first_[b];
+    }
+    entries_.resize(count);
+    auto cursor = first_;
+    for (std::size_t i = 0; i < count; i++) {
+      entries_[cursor[bucket[i]]++] = unsorted[i];
+    }
+  }
+
+  // Hands out the entities of the cells overlapping the box that pass
+  // `accept`.
+  template <class Fn, class Accept>
+  void visit(float min_x, float min_y, float max_x, float max_y, Fn &fn,
+             Accept &&accept) const {
+    // Also true if a bound is NaN, nothing passes `accept` then.
+    if (!(min_x <= max_x && min_y <= max_y)) {
+      return;
+    }
+    std::array<entry, batch_size> batch;
+    std::size_t size = 0;
+    const auto push = [&](const entry &e) {
+      batch[size++] = e;
+      if (size == batch.size()) {
+        fn(std::span<const entry>{batch.data(), size});
+        size = 0;
+      }
+    };
+
+    const auto x0 = cell_of(min_x);
+    const auto y0 = cell_of(min_y);
+    const auto x1 = cell_of(max_x);
+    const auto y1 = cell_of(max_y);
+    const auto cells = (static_cast<double>(x1) - x0 + 1) *
+                       (static_cast<double>(y1) - y0 + 1);
+    if (cells >= static_cast<double>(first_.size() - 1)) {
+      // Larger than the grid, every bucket would be read anyway.
+      for (const auto &e : entries_) {
+        if (accept(e)) {
+          push(e);
+        }
+      }
+    } else {
+      // Wide enough not to overflow past the last cell of the int32 range.
+      for (std::int64_t cy = y0; cy <= y1; cy++) {
+        for (std::int64_t cx = x0; cx <= x1; cx++) {
+          const auto b = bucket_of(static_cast<std::int32_t>(cx),
+                                   static_cast<std::int32_t>(cy));
+          for (auto i = first_[b]; i < first_[b + 1]; i++) {
+            const auto &e = entries_[i];
+            // Other cells can share the bucket.
+            if (cell_of(e.x) == cx && cell_of(e.y) == cy && accept(e)) {
+              push(e);
+            }
+          }
+        }
+      }
+    }
+    if (size != 0) {
+      fn(std::span<const entry>{batch.data(), size});
+    }
+  }
+};
+
+} // namespace ecs
@@ -0,0 +1,599 @@
+// Regression tests of the ECS, run by ctest:
+//
+//   ecs_tests [--filter SUBSTRING]
+//
+// A failed check prints its location and fails the run, the other checks and
+// tests still run.
+#include "delta.h"
+#include "ecs.h"
+#include "hierarchy.h"
+#include "nostd.h"
+#include "profiler.h"
+#include "scheduler.h"
+#include "snapshot.h"
+#include "spatial.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <filesystem>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace {
+
+struct pos {
+  float x;
+  float y;
+};
+struct burning {
+  std::uint32_t ticks;
+};
+
+using World = ecs::basic_world<ecs::StaticRegistry<pos, burning>>;
+
+int failures = 0;
+
+#define CHECK(...)                                                             \
+  do {                                                                         \
+    if (!(__VA_ARGS__)) {                                                      \
+      nostd::println("{}:{}: check failed: {}", __FILE__, __LINE__,            \
+                     #__VA_ARGS__);                                            \
+      failures++;                                                              \
+    }                                                                          \
+  } while (false)
+
+// Entities visited by a run of a query of terms `Ts`, see
+// basic_world::query.
+template <class... Ts>
+std::size_t count(World &world, std::uint64_t &last_run) {
+  std::size_t n = 0;
+  for (auto item : world.query<Ts...>(last_run)) {
+    (void)item;
+    n++;
+  }
+  return n;
+}
+
+// An entity added to an older chunk it migrates to still passes Added.
+void added_survives_migration() {
+  World world;
+  std::uint64_t last_run = 0;
+  world.insert(pos{}, burning{});
+  CHECK(count<ecs::Added<pos>, const pos>(world, last_run) == 1);
+  CHECK(count<ecs::Added<pos>, const pos>(world, last_run) == 0);
+
+  const auto e = world.insert(pos{});
+  world.add(e, burning{});
+  CHECK(count<ecs::Added<pos>, const pos>(world, last_run) == 2);
+}
+
+// Same for an entity moved into a hole by a dense despawn.
+void added_survives_dense_despawn() {
+  World world;
+  std::uint64_t last_run = 0;
+  const auto first = world.insert(pos{});
+  const auto capacity = world.archetypes_[0].layout.capacity;
+  for (std::size_t i = 1; i < capacity; i++) {
+    world.insert(pos{});
+  }
+  CHECK(count<ecs::Added<pos>, const pos>(world, last_run) == capacity);
+  CHECK(count<ecs::Added<pos>, const pos>(world, last_run) == 0);
+
+  // Alone in a second chunk, then moved into the hole of the first.
+  world.insert(pos{});
+  world.despawn(first);
+  CHECK(world.archetypes_[0].data.chunks().size() == 1);
+  CHECK(count<ecs::Added<pos>, const pos>(world, last_run) == capacity);
+}
+
+// Consumers of the same query don't take each other's changes.
+void consumers_see_changes_apart() {
+  World world;
+  const auto e = world.insert(pos{});
+  std::uint64_t a = 0;
+  std::uint64_t b = 0;
+  CHECK(count<ecs::Changed<pos>, const pos>(world, a) == 1);
+  CHECK(count<ecs::Changed<pos>, const pos>(world, b) == 1);
+
+  std::get<0>(world.entity<pos>(e)).x = 1;
+  CHECK(count<ecs::Changed<pos>, const pos>(world, a) == 1);
+  CHECK(count<ecs::Changed<pos>, const pos>(world, b) == 1);
+  CHECK(count<ecs::Changed<pos>, const pos>(world, a) == 0);
+  CHECK(count<ecs::Changed<pos>, const pos>(world, b) == 0);
+}
+
+// The names of the systems stay readable by the profiler once their
+// scheduler is gone.
+void profiled_system_names_outlive_scheduler() {
+  auto &profiler = ecs::profiler::global();
+  profiler.clear();
+  World world;
+  {
+    std::optional<ecs::scheduler<World>> scheduler;
+    scheduler.emplace();
+    // Too long to be stored inline by std::string.
+    std::string name(64, 's');
+    scheduler->add({.name = name, .reads = {}, .writes = {}},
+                   [](World &) {});
+    name.assign(64, 'x');
+    scheduler->run(world);
+    scheduler.reset();
+  }
+  const auto summary = profiler.summary();
+  CHECK(std::ranges::any_of(summary, [](const auto &stats) {
+    return stats.name == std::string(64, 's');
+  }));
+  profiler.clear();
+}
+
+// Whether restoring the snapshot of a small world throws once `corrupt` has
+// been given its archetype record and the entity table.
+template <class Fn> bool corrupt_snapshot_throws(Fn &&corrupt) {
+  constexpr auto N = ecs::StaticRegistry<pos, burning>::max_components;
+  const auto path =
+      (std::filesystem::temp_directory_path() / "ecs_tests.snap").string();
+  {
+    World world;
+    world.insert(pos{}, burning{});
+    world.insert(pos{}, burning{});
+    world.despawn(world.insert(pos{}));
+    ecs::save_snapshot(world, path.c_str());
+  }
+
+  ecs::snapshot_file file{path.c_str()};
+  ecs::snapshot_reader r{file.bytes()};
+  const auto header = r.read<ecs::snapshot_header>();
+  auto *entities = reinterpret_cast<ecs::entity_location *>(
+      r.take(header.entities * sizeof(ecs::entity_location),
+             alignof(ecs::entity_location)));
+  r.read<std::uint32_t>(header.free_entities);
+  auto *record = reinterpret_cast<ecs::snapshot_archetype<N> *>(
+      r.take(sizeof(ecs::snapshot_archetype<N>),
+             alignof(ecs::snapshot_archetype<N>)));
+  corrupt(*record, std::span{entities, header.entities});
+
+  World world;
+  try {
+    file.restore(world);
+  } catch (const std::runtime_error &) {
+    return true;
+  }
+  return false;
+}
+
+// Snapshots whose layouts or entity table don't match their chunks are
+// rejected instead of read out of bounds.
+void corrupt_snapshots_throw() {
+  const auto none = [](auto &, auto) {};
+  CHECK(!corrupt_snapshot_throws(none));
+  CHECK(corrupt_snapshot_throws(
+      [](auto &record, auto) { record.layout.chunk_size *= 2; }));
+  CHECK(corrupt_snapshot_throws(
+      [](auto &record, auto) { record.layout.alignment = 3; }));
+  CHECK(corrupt_snapshot_throws(
+      [](auto &record, auto) { record.layout.capacity++; }));
+  CHECK(corrupt_snapshot_throws([](auto &, auto entities) {
+    entities[0].archetype = 1000;
+  }));
+  CHECK(corrupt_snapshot_throws([](auto &, auto entities) {
+    entities[0].idx = hive_entry_info_t{0, 1000}.to_hive_index();
+  }));
+  // Both entities in the same slot.
+  CHECK(corrupt_snapshot_throws(
+      [](auto &, auto entities) { entities[1] = entities[0]; }));
+}
+
+// Boxes past the int32 range of cells, unbounded or NaN ones, and entities
+// out there or at NaN are queried without overflowing.
+void unbounded_spatial_queries() {
+  constexpr auto inf = std::numeric_limits<float>::infinity();
+  constexpr auto nan = std::numeric_limits<float>::quiet_NaN();
+  World world;
+  world.insert(pos{0, 0});
+  world.insert(pos{1e30f, -1e30f});
+  world.insert(pos{inf, 3});
+  world.insert(pos{nan, 0});
+  ecs::spatial_grid<World, pos> grid{1};
+  grid.update(world);
+
+  const auto count = [&](float min_x, float min_y, float max_x, float max_y) {
+    std::size_t n = 0;
+    grid.query_box(min_x, min_y, max_x, max_y,
+                   [&](auto batch) { n += batch.size(); });
+    return n;
+  };
+  CHECK(count(-1e30f, -1e30f, 1e30f, 1e30f) == 2);
+  CHECK(count(-inf, -inf, inf, inf) == 3);
+  CHECK(count(1e30f, -1e30f, 1e30f, -1e30f) == 1);
+  CHECK(count(inf, 0, inf, 5) == 1);
+  // A thin box at the end of the range, whose cells are not all scanned.
+  CHECK(count(1e30f, -inf, inf, -1e30f) == 1);
+  CHECK(count(nan, -inf, inf, inf) == 0);
+  CHECK(count(1, 1, -1, -1) == 0);
+
+  std::size_t n = 0;
+  grid.query_radius(0, 0, inf, [&](auto batch) { n += batch.size(); });
+  grid.query_radius(nan, 0, 1, [&](auto batch) { n += batch.size(); });
+  CHECK(n == 3);
+}
+
+template <std::size_t I> struct tagged {
+  std::uint32_t value;
+};
+
+template <std::size_t I> void insert_tagged(ecs::DynamicWorld &world) {
+  for (std::uint32_t i = 0; i < 100; i++) {
+    world.commands().insert(tagged<I>{i});
+  }
+}
+
+// Components first met by systems running in parallel, through commands(),
+// are registered once each.
+void dynamic_registry_concurrent_lookups() {
+  ecs::DynamicWorld world;
+  ecs::thread_pool pool{4};
+  ecs::scheduler<ecs::DynamicWorld> scheduler;
+  scheduler.add({.name = "a", .reads = {}, .writes = {}}, insert_tagged<0>);
+  scheduler.add({.name = "b", .reads = {}, .writes = {}}, insert_tagged<1>);
+  scheduler.add({.name = "c", .reads = {}, .writes = {}}, insert_tagged<2>);
+  scheduler.run(world, pool);
+
+  CHECK(world.registry.count() == 3);
+  const std::size_t indices[] = {
+      world.registry.index<tagged<0>>(),
+      world.registry.index<tagged<1>>(),
+      world.registry.index<tagged<2>>(),
+  };
+  CHECK(indices[0] != indices[1] && indices[1] != indices[2] &&
+        indices[0] != indices[2]);
+  std::size_t n = 0;
+  for (auto [t] : world.query<const tagged<1>>()) {
+    n += t.value < 100;
+  }
+  CHECK(n == 100);
+}
+
+struct flag {
+  static constexpr ecs::storage_policy storage =
+      ecs::storage_policy::sparse_set;
+  std::uint32_t value;
+};
+
+using FlagWorld = ecs::basic_world<ecs::StaticRegistry<pos, burning, flag>>;
+
+// The commands of each entity are folded into its final archetype and
+// values, stale handles are ignored and inserts apply last.
+void flush_folds_commands() {
+  FlagWorld world;
+  const auto folded = world.insert(pos{1, 2});
+  const auto revived = world.insert(pos{});
+  const auto toggled = world.insert(pos{});
+  const auto flagged = world.insert(pos{});
+  const auto stale = world.insert(pos{});
+  world.despawn(stale);
+  const auto reused = world.insert(pos{3, 4});
+  CHECK(ecs::entity_info::from_entity_t(reused).index ==
+        ecs::entity_info::from_entity_t(stale).index);
+  const auto freed = world.insert(pos{});
+
+  auto &commands = world.commands();
+  commands.add(folded, burning{5});
+  commands.add(folded, burning{7});
+  commands.remove<pos>(folded);
+  // Nothing applies to a despawned entity, even if recorded after.
+  commands.despawn(revived);
+  commands.add(revived, burning{1});
+  commands.add(toggled, flag{1});
+  commands.remove<flag>(toggled);
+  commands.add(flagged, flag{3});
+  // Same index as `reused`.
+  commands.add(stale, burning{2});
+  // The insert can take the index of `freed` without being despawned.
+  commands.despawn(freed);
+  commands.insert(pos{9, 9});
+  world.flush();
+
+  CHECK(world.has<burning>(folded) && !world.has<pos>(folded));
+  CHECK(std::get<0>(world.entity<const burning>(folded)).ticks == 7);
+  CHECK(!world.alive(revived) && !world.alive(freed));
+  CHECK(!world.has<flag>(toggled));
+  CHECK(world.has<flag>(flagged));
+  CHECK(std::get<0>(world.entity<const flag>(flagged)).value == 3);
+  CHECK(!world.has<burning>(reused));
+  CHECK(std::get<0>(world.entity<const pos>(reused)).x == 3);
+
+  std::size_t inserted = 0;
+  for (auto [p] : world.query<const pos>()) {
+    inserted += p.x == 9 && p.y == 9;
+  }
+  CHECK(inserted == 1);
+  CHECK(world.commands().commands().empty());
+}
+
+// Whether `a` and `b` have the same entity tables, chunks and sparse sets:
+// same change ticks, and same bytes in the live slots, padding aside.
+bool same_bytes(FlagWorld &a, FlagWorld &b) {
+  if (a.entities_.size() != b.entities_.size() ||
+      a.archetypes_.size() != b.archetypes_.size() ||
+      std::memcmp(a.entities_.data(), b.entities_.data(),
+                  a.entities_.size() * sizeof(ecs::entity_location)) != 0) {
+    return false;
+  }
+  for (std::size_t i = 0; i < a.archetypes_.size(); i++) {
+    auto &x = a.archetypes_[i];
+    auto &y = b.archetypes_[i];
+    const auto ticks_size = x.types.count() * sizeof(ecs::change_ticks);
+    if (x.data.chunks().size() != y.data.chunks().size()) {
+      return false;
+    }
+    for (std::size_t c = 0; c < x.data.chunks().size(); c++) {
+      auto &cx = x.data.chunks()[c];
+      auto &cy = y.data.chunks()[c];
+      if (cx.allocated() != cy.allocated()) {
+        return false;
+      }
+      if (!cx.allocated()) {
+        continue;
+      }
+      if (!std::equal(cx.occupied.get(), cx.occupied.get() + cx.words(),
+                      cy.occupied.get()) ||
+          std::memcmp(cx.data.get(), cy.data.get(), ticks_size) != 0) {
+        return false;
+      }
+      for (std::uint32_t s = 0; s < cx.top; s++) {
+        if (!cx.live(s)) {
+          continue;
+        }
+        bool same = x.entity_at(cx.slot(s)) == y.entity_at(cy.slot(s));
+        x.types.for_each([&](std::size_t t) {
+          same = same && std::memcmp(x.at(cx.slot(s), t), y.at(cy.slot(s), t),
+                                     a.registry.size(t)) == 0;
+        });
+        if (!same) {
+          return false;
+        }
+      }
+    }
+  }
+  const auto &x = a.sparse_set_of(a.registry.index<flag>());
+  const auto &y = b.sparse_set_of(b.registry.index<flag>());
+  return std::ranges::equal(x.entities(), y.entities()) &&
+         std::ranges::equal(x.bytes(), y.bytes()) &&
+         x.all_ticks().size() == y.all_ticks().size() &&
+         std::memcmp(x.all_ticks().data(), y.all_ticks().data(),
+                     x.all_ticks().size_bytes()) == 0;
+}
+
+// Stamps the change ticks of every chunk and sparse set of `world`, without
+// writing a component.
+void stamp(FlagWorld &world) {
+  for (auto [p, f] : world.query<pos, ecs::Optional<flag>>()) {
+    (void)p;
+    (void)f;
+  }
+}
+
+// Random changes encoded frame after frame rebuild the source world in a
+// replica, change ticks included, even if the replica is read through
+// non-const terms.
+void delta_round_trips() {
+  using Registry = ecs::StaticRegistry<pos, burning, flag>;
+  for (const auto mode :
+       {ecs::storage_mode::columns, ecs::storage_mode::rows}) {
+    for (const bool dense : {true, false}) {
+      for (const bool xor_previous : {true, false}) {
+        FlagWorld source;
+        FlagWorld replica;
+        source.storage = mode;
+        source.dense = dense;
+        source.chunk_bytes = 1024;
+        ecs::delta_encoder<Registry> encoder{{.xor_previous = xor_previous}};
+        std::vector<ecs::entity_t> entities;
+        std::mt19937 rng{1};
+        for (std::uint32_t i = 0; i < 500; i++) {
+          entities.push_back(source.insert(pos{float(i), 0}, burning{i}));
+        }
+
+        for (int frame = 0; frame < 20; frame++) {
+          // Resends the ticks the replica stamped after the last frame.
+          if (frame % 2 == 0) {
+            stamp(source);
+          }
+          for (int k = 0; k < 50; k++) {
+            const auto e = entities[rng() % entities.size()];
+            if (!source.alive(e)) {
+              continue;
+            }
+            switch (rng() % 6) {
+            case 0:
+              source.despawn(e);
+              break;
+            case 1:
+              source.remove<burning>(e);
+              break;
+            case 2:
+              source.add(e, flag{std::uint32_t(rng())});
+              break;
+            case 3:
+              source.remove<flag>(e);
+              break;
+            case 4:
+              std::get<0>(source.entity<pos>(e)).y = float(rng() % 100);
+              break;
+            case 5:
+              entities.push_back(source.insert(pos{}, flag{}));
+              break;
+            }
+          }
+          if (frame % 5 == 2) {
+            source.defragment(100);
+          } else if (frame % 5 == 4) {
+            source.sort_by<pos>([](const pos &p) { return p.y; });
+          }
+
+          std::ostringstream out;
+          encoder.encode(source, out);
+          auto bytes = std::move(out).str();
+          ecs::apply_delta(replica,
+                           std::as_writable_bytes(std::span{bytes}));
+          CHECK(same_bytes(source, replica));
+          if (frame % 2 == 1) {
+            stamp(replica);
+          }
+        }
+      }
+    }
+  }
+}
+
+// Neighbor cells of a row end up next to each other in the grid.
+void spatial_neighbors_are_close() {
+  World world;
+  for (int y = 0; y < 16; y++) {
+    for (int x = 0; x < 16; x++) {
+      world.insert(pos{x + 0.5f, y + 0.5f});
+    }
+  }
+  ecs::spatial_grid<World, pos> grid{1};
+  grid.update(world);
+
+  const auto entries = grid.entries();
+  const auto index_of = [&](int x, int y) {
+    return std::ranges::find_if(entries, [&](const auto &e) {
+             return int(e.x) == x && int(e.y) == y;
+           }) -
+           entries.begin();
+  };
+  for (int y = 0; y < 16; y++) {
+    for (int x = 0; x + 1 < 16; x++) {
+      const auto step = index_of(x + 1, y) - index_of(x, y);
+      CHECK((step + 256) % 256 == 1);
+    }
+  }
+}
+
+// Range-for runs of a query are profiled under the name of its terms.
+void range_for_queries_are_profiled() {
+  auto &profiler = ecs::profiler::global();
+  profiler.clear();
+  World world;
+  world.insert(pos{}, burning{});
+  world.insert(pos{}, burning{});
+  for (auto [p, b] : world.query<const pos, const burning>()) {
+    (void)p;
+    (void)b;
+  }
+  // Left early, not recorded.
+  for (auto [p, b] : world.query<const pos, const burning>()) {
+    (void)p;
+    (void)b;
+    break;
+  }
+
+  std::size_t runs = 0;
+  for (const auto &stats : profiler.summary()) {
+    if (stats.name.find("burning") != std::string_view::npos) {
+      runs += stats.count;
+    }
+  }
+  CHECK(runs == 1);
+  profiler.clear();
+}
+
+struct alignas(32) wide {
+  float x;
+};
+
+using TreeWorld =
+    ecs::basic_world<ecs::StaticRegistry<pos, burning, wide, ecs::ChildOf>>;
+
+// Propagations reusing the buffers of the previous ones, of other types
+// included, start from value initialized locals and globals.
+void propagations_reuse_buffers() {
+  TreeWorld world;
+  const auto root = world.insert(pos{1, 0}, wide{1});
+  const auto child = world.insert(ecs::ChildOf{root}, burning{2}, pos{});
+  const auto leaf =
+      world.insert(ecs::ChildOf{child}, burning{3}, pos{}, wide{});
+  // No Local, composed from a value initialized one.
+  const auto bare = world.insert(ecs::ChildOf{root}, pos{5, 5});
+  ecs::thread_pool pool{2};
+  ecs::hierarchy<TreeWorld> tree;
+  tree.update(world);
+
+  const auto x = [&](ecs::entity_t e) {
+    return std::get<0>(world.entity<const pos>(e)).x;
+  };
+  for (int run = 0; run < 2; run++) {
+    tree.propagate<burning, pos>(
+        world,
+        [](const pos &parent, const burning &local) {
+          return pos{parent.x + float(local.ticks), parent.y};
+        },
+        1, pool);
+    const auto r = x(root);
+    CHECK(x(child) == r + 2 && x(leaf) == r + 5 && x(bare) == r);
+    std::get<0>(world.entity<pos>(root)).x = r + 1;
+  }
+
+  tree.propagate<burning, wide>(
+      world,
+      [](const wide &parent, const burning &local) {
+        return wide{parent.x * float(local.ticks)};
+      },
+      1, pool);
+  CHECK(std::get<0>(world.entity<const wide>(leaf)).x == 6);
+}
+
+struct test {
+  std::string_view name;
+  void (*run)();
+};
+
+constexpr test tests[] = {
+    {"added_survives_migration", added_survives_migration},
+    {"added_survives_dense_despawn", added_survives_dense_despawn},
+    {"consumers_see_changes_apart", consumers_see_changes_apart},
+    {"profiled_system_names_outlive_scheduler",
+     profiled_system_names_outlive_scheduler},
+    {"range_for_queries_are_profiled", range_for_queries_are_profiled},
+    {"corrupt_snapshots_throw", corrupt_snapshots_throw},
+    {"unbounded_spatial_queries", unbounded_spatial_queries},
+    {"spatial_neighbors_are_close", spatial_neighbors_are_close},
+    {"dynamic_registry_concurrent_lookups",
+     dynamic_registry_concurrent_lookups},
+    {"flush_folds_commands", flush_folds_commands},
+    {"delta_round_trips", delta_round_trips},
+    {"propagations_reuse_buffers", propagations_reuse_buffers},
+};
+
+} // namespace
+
+int main(int argc, char **argv) {
+  std::string_view filter;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    if (std::string_view{argv[i]} == "--filter") {
+      filter = argv[i + 1];
+    }
+  }
+
+  for (const auto &t : tests) {
+    if (t.name.find(filter) == std::string_view::npos) {
+      continue;
+    }
+    const auto before = failures;
+    t.run();
+    nostd::println("{} {}", failures == before ? "ok" : "FAILED", t.name);
+  }
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,189 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace ecs {
+
+// Persistent pool of workers, each owning a queue of jobs. Workers pop their
+// own queue from the back and steal from the front of the others when they
+// run dry.
+//
+// Threads waiting on a parallel_for run jobs themselves instead of blocking,
+// so parallel_for can be nested from inside a job.
+class thread_pool {
+  struct job {
+    void (*fn)(void *, std::size_t);
+    void *ctx;
+    std::size_t index;
+  };
+
+  struct queue {
+    std::mutex mutex;
+    std::deque<job> jobs;
+  };
+
+  // queues_[0] is shared by the threads not owned by the pool.
+  std::vector<std::unique_ptr<queue>> queues_;
+  std::vector<std::thread> threads_;
+
+  std::mutex sleep_mutex_;
+  std::condition_variable wake_;
+  std::atomic<std::size_t> queued_ = 0;
+  bool stop_ = false;
+
+  static inline thread_local std::size_t current_queue_ = 0;
+  static inline thread_local const thread_pool *current_pool_ = nullptr;
+
+  std::size_t own_queue() const {
+    return current_pool_ == this ? current_queue_ : 0;
+  }
+
+  std::optional<job> try_pop(std::size_t q) {
+    {
+      auto &own = *queues_[q];
+      std::scoped_lock lock{own.mutex};
+      if (!own.jobs.empty()) {
+        const auto j = own.jobs.back();
+        own.jobs.pop_back();
+        queued_.fetch_sub(1, std::memory_order_relaxed);
+        return j;
+      }
+    }
+
+    for (std::size_t i = 1; i < queues_.size(); i++) {
+      auto &victim = *queues_[(q + i) % queues_.size()];
+      std::scoped_lock lock{victim.mutex};
+      if (!victim.jobs.empty()) {
+        const auto j = victim.jobs.front();
+        victim.jobs.pop_front();
+        queued_.fetch_sub(1, std::memory_order_relaxed);
+        return j;
+      }
+    }
+    return std::nullopt;
+  }
+
+  void worker(std::size_t q) {
+    current_pool_ = this;
+    current_queue_ = q;
+    while (true) {
+      if (const auto j = try_pop(q)) {
+        j->fn(j->ctx, j->index);
+        continue;
+      }
+
+      std::unique_lock lock{sleep_mutex_};
+      wake_.wait(lock, [&] {
+        return stop_ || queued_.load(std::memory_order_relaxed) != 0;
+      });
+      if (stop_) {
+        return;
+      }
+    }
+  }
+
+public:
+  // The calling thread takes part in the work, hence one worker less than
+  // there are cores by default.
+  static std::size_t default_workers() {
+    return std::max(std::thread::hardware_concurrency(), 1u) - 1;
+  }
+
+  explicit thread_pool(std::size_t workers = default_workers()) {
+    queues_.reserve(workers + 1);
+    for (std::size_t i = 0; i < workers + 1; i++) {
+      queues_.push_back(std::make_unique<queue>());
+    }
+    threads_.reserve(workers);
+    for (std::size_t i = 0; i < workers; i++) {
+      threads_.emplace_back([this, i] { worker(i + 1); });
+    }
+  }
+
+  ~thread_pool() {
+    {
+      std::scoped_lock lock{sleep_mutex_};
+      stop_ = true;
+    }
+    wake_.notify_all();
+    for (auto &t : threads_) {
+      t.join();
+    }
+  }
+
+  thread_pool(const thread_pool &) = delete;
+  thread_pool &operator=(const thread_pool &) = delete;
+
+  static thread_pool &global() {
+    static thread_pool pool;
+    return pool;
+  }
+
+  // Number of threads running jobs, the caller of parallel_for included.
+  std::size_t concurrency() const { return threads_.size() + 1; }
+
+  // Runs `fn(i)` for every i in [0, count) and waits for all of them.
+  template <class Fn> void parallel_for(std::size_t count, Fn &&fn) {
+    parallel_for(count, std::forward<Fn>(fn), [] {});
+  }
+
+  // Same as above, but `local()` runs on the calling thread while the jobs
+  // are being picked up by the workers.
+  template <class Fn, class Local>
+  void parallel_for(std::size_t count, Fn &&fn, Local &&local) {
+    if (count <= 1 || threads_.empty()) {
+      local();
+      for (std::size_t i = 0; i < count; i++) {
+        fn(i);
+      }
+      return;
+    }
+
+    struct context {
+      Fn &fn;
+      std::atomic<std::size_t> remaining;
+    } ctx{fn, count};
+    const auto run = [](void *c, std::size_t i) {
+      auto &ctx = *static_cast<context *>(c);
+      ctx.fn(i);
+      ctx.remaining.fetch_sub(1, std::memory_order_release);
+    };
+
+    const auto q = own_queue();
+    {
+      auto &own = *queues_[q];
+      std::scoped_lock lock{own.mutex};
+      // Pushed in reverse so that the owner pops them in order.
+      for (std::size_t i = count; i-- > 0;) {
+        own.jobs.push_back({run, &ctx, i});
+      }
+      queued_.fetch_add(count, std::memory_order_relaxed);
+    }
+    {
+      // Taking the lock orders the wake up after the sleepers checked
+      // `queued_`.
+      std::scoped_lock lock{sleep_mutex_};
+    }
+    wake_.notify_all();
+
+    local();
+    while (ctx.remaining.load(std::memory_order_acquire) != 0) {
+      if (const auto j = try_pop(q)) {
+        j->fn(j->ctx, j->index);
+      } else {
+        std::this_thread::yield();
+      }
+    }
+  }
+};
+} // namespace ecs
@@ -0,0 +1,207 @@
+#pragma once
+
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <initializer_list>
+#include <span>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+namespace ecs {
+
+// A set of component type indices below N, stored as 64 bit words so that
+// it is usable at compile time and unions, intersections and subset tests
+// go a word at a time, whatever N.
+template <const std::size_t N> class type_set {
+public:
+  static constexpr std::size_t word_count = (N + 63) / 64;
+  using words_t = std::array<std::uint64_t, word_count>;
+
+  constexpr type_set() = default;
+  // Bit i of the set is bit i % 64 of words[i / 64].
+  constexpr explicit type_set(const words_t &words) : words_(words) {
+    trim();
+  }
+  static constexpr type_set of(std::initializer_list<std::size_t> indices) {
+    type_set out;
+    for (const auto i : indices) {
+      out.set(i);
+    }
+    return out;
+  }
+
+  constexpr std::size_t size() const { return N; }
+  constexpr const words_t &words() const { return words_; }
+
+  constexpr bool test(std::size_t i) const {
+    return (words_[i / 64] >> (i % 64)) & 1;
+  }
+  constexpr type_set &set(std::size_t i, bool value = true) {
+    const auto bit = std::uint64_t{1} << (i % 64);
+    words_[i / 64] = value ? words_[i / 64] | bit : words_[i / 64] & ~bit;
+    return *this;
+  }
+  constexpr type_set &reset(std::size_t i) { return set(i, false); }
+
+  constexpr bool any() const {
+    std::uint64_t acc = 0;
+    for (const auto w : words_) {
+      acc |= w;
+    }
+    return acc != 0;
+  }
+  constexpr bool none() const { return !any(); }
+  constexpr std::size_t count() const {
+    std::size_t n = 0;
+    for (const auto w : words_) {
+      n += static_cast<std::size_t>(std::popcount(w));
+    }
+    return n;
+  }
+
+  // Whether every index of `other` is in the set.
+  constexpr bool contains(const type_set &other) const {
+    std::uint64_t missing = 0;
+    for (std::size_t w = 0; w < word_count; w++) {
+      missing |= other.words_[w] & ~words_[w];
+    }
+    return missing == 0;
+  }
+  constexpr bool intersects(const type_set &other) const {
+    std::uint64_t common = 0;
+    for (std::size_t w = 0; w < word_count; w++) {
+      common |= other.words_[w] & words_[w];
+    }
+    return common != 0;
+  }
+
+  // Calls `fn(i)` for the indices of the set, in increasing order.
+  template <class Fn> constexpr void for_each(Fn &&fn) const {
+    for (std::size_t w = 0; w < word_count; w++) {
+      for (auto bits = words_[w]; bits != 0; bits &= bits - 1) {
+        fn(w * 64 + static_cast<std::size_t>(std::countr_zero(bits)));
+      }
+    }
+  }
+
+  std::size_t hash() const {
+    std::uint64_t h = 0;
+    for (const auto w : words_) {
+      h = (h ^ w) * 0x9e3779b97f4a7c15;
+      h ^= h >> 32;
+    }
+    return static_cast<std::size_t>(h);
+  }
+
+  constexpr type_set &operator&=(const type_set &other) {
+    for (std::size_t w = 0; w < word_count; w++) {
+      words_[w] &= other.words_[w];
+    }
+    return *this;
+  }
+  constexpr type_set &operator|=(const type_set &other) {
+    for (std::size_t w = 0; w < word_count; w++) {
+      words_[w] |= other.words_[w];
+    }
+    return *this;
+  }
+  constexpr type_set &operator^=(const type_set &other) {
+    for (std::size_t w = 0; w < word_count; w++) {
+      words_[w] ^= other.words_[w];
+    }
+    return *this;
+  }
+  constexpr type_set operator~() const {
+    type_set out;
+    for (std::size_t w = 0; w < word_count; w++) {
+      out.words_[w] = ~words_[w];
+    }
+    out.trim();
+    return out;
+  }
+
+  friend constexpr type_set operator&(type_set a, const type_set &b) {
+    return a &= b;
+  }
+  friend constexpr type_set operator|(type_set a, const type_set &b) {
+    return a |= b;
+  }
+  friend constexpr type_set operator^(type_set a, const type_set &b) {
+    return a ^= b;
+  }
+  friend constexpr bool operator==(const type_set &,
+                                   const type_set &) = default;
+
+private:
+  words_t words_{};
+
+  // Clears the bits past N.
+  constexpr void trim() {
+    if constexpr (N % 64 != 0) {
+      words_.back() &= (std::uint64_t{1} << (N % 64)) - 1;
+    }
+  }
+};
+
+// Calls `fn(i)` for the indices of the sets of `sets` that contain all of
+// `required` and none of `excluded`, in increasing order. Tests four words
+// at once with AVX2.
+template <const std::size_t N, class Fn>
+void match_type_sets(std::span<const type_set<N>> sets,
+                     const type_set<N> &required,
+                     const type_set<N> &excluded, Fn &&fn) {
+  constexpr auto W = type_set<N>::word_count;
+  const auto &req = required.words();
+  const auto &exc = excluded.words();
+#if defined(__AVX2__)
+  if constexpr (W % 4 == 0) {
+    __m256i r[W / 4];
+    __m256i e[W / 4];
+    for (std::size_t v = 0; v < W / 4; v++) {
+      r[v] = _mm256_loadu_si256(
+          reinterpret_cast<const __m256i *>(req.data() + 4 * v));
+      e[v] = _mm256_loadu_si256(
+          reinterpret_cast<const __m256i *>(exc.data() + 4 * v));
+    }
+    for (std::size_t i = 0; i < sets.size(); i++) {
+      const auto *words = sets[i].words().data();
+      auto acc = _mm256_setzero_si256();
+      for (std::size_t v = 0; v < W / 4; v++) {
+        const auto s = _mm256_loadu_si256(
+            reinterpret_cast<const __m256i *>(words + 4 * v));
+        // The required types it lacks and the excluded ones it has.
+        const auto missing = _mm256_andnot_si256(s, r[v]);
+        const auto unwanted = _mm256_and_si256(s, e[v]);
+        acc = _mm256_or_si256(acc, _mm256_or_si256(missing, unwanted));
+      }
+      if (_mm256_testz_si256(acc, acc)) {
+        fn(i);
+      }
+    }
+    return;
+  }
+#endif
+  for (std::size_t i = 0; i < sets.size(); i++) {
+    const auto &words = sets[i].words();
+    std::uint64_t acc = 0;
+    for (std::size_t w = 0; w < W; w++) {
+      acc |= (req[w] & ~words[w]) | (exc[w] & words[w]);
+    }
+    if (acc == 0) {
+      fn(i);
+    }
+  }
+}
+
+} // namespace ecs
+
+template <const std::size_t N> struct std::hash<ecs::type_set<N>> {
+  std::size_t operator()(const ecs::type_set<N> &types) const {
+    return types.hash();
+  }
+};